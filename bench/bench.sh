@@ -0,0 +1,105 @@
+#!/bin/sh
+#Benchmark of pluck on synthetic databases: stage 1 and stage 2, dry run and trim.
+#Usage: bench.sh path/to/pluck path/to/pluck-gen directory
+#Directory must be on the tested filesystem: ext4 or XFS loop image, or tmpfs.
+#BENCH_PAGES is pages count of every database, default 65536.
+#BENCH_DROP_CACHES=1 drops page cache before every run, it needs root.
+#Syscalls are counted by strace when it is installed, otherwise fallocate calls are taken from pluck report.
+#Trimmed file of every trim run is verified by pluck-gen: used data must be the same, exit status is 1 if it isn't.
+
+PLUCK=$1
+GEN=$2
+DIR=$3
+PAGES=${BENCH_PAGES:-65536}
+
+if [ -z "$PLUCK" ] || [ -z "$GEN" ] || [ -z "$DIR" ]; then
+    echo "Usage: $0 path/to/pluck path/to/pluck-gen directory"
+    exit 1
+fi
+mkdir -p "$DIR" || exit 1
+STRACE=$(command -v strace)
+
+#name|pluck-gen options|pluck options of all runs
+CONFIGS="ods11-8k|--ods 11 --page-size 8192|-b 4096
+ods12-8k-512|--ods 12 --page-size 8192|-b 512
+ods13-16k-holes|--ods 13 --page-size 16384 --holes 30|-b 4096
+ods12-32k-btree|--ods 12 --page-size 32768 --mix 10,70,10,10 --fill 30-90|-b 4096
+ods12-8k-zero|--ods 12 --page-size 8192 --zero 50 --free 10|-b 512"
+
+#name|pluck options
+MODES="s1-dry|-s 1
+s1-trim|-s 1 -t
+s2-dry|
+s2-dry-p4|-p 4
+s2-trim-p4|-p 4 -t"
+
+drop_caches() {
+    if [ "$BENCH_DROP_CACHES" = "1" ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+#Fresh copy of database for every run, trim changes it
+prepare() {
+    cp --sparse=always "$DIR/$1.fdb" "$DIR/work.fdb" || exit 1
+    drop_caches
+}
+
+printf "%-18s %-11s %9s %8s %11s %9s %9s %9s %6s\n" config mode pages seconds pages/s MiB/s syscalls fallocate verify
+rm -f "$DIR/failed"
+echo "$CONFIGS" | while IFS='|' read -r config gen_options pluck_options; do
+    # shellcheck disable=SC2086
+    "$GEN" -f "$DIR/$config.fdb" -n "$PAGES" $gen_options > /dev/null || exit 1
+    size=$(stat -c %s "$DIR/$config.fdb")
+    echo "$MODES" | while IFS='|' read -r mode mode_options; do
+        prepare "$config"
+        start=$(date +%s.%N)
+        # shellcheck disable=SC2086
+        "$PLUCK" $pluck_options $mode_options -f "$DIR/work.fdb" > "$DIR/report.txt" 2>&1
+        finish=$(date +%s.%N)
+        syscalls="-"
+        verify="-"
+        case "$mode_options" in
+            *-t*)
+                if "$GEN" --verify "$DIR/$config.fdb" -f "$DIR/work.fdb" > "$DIR/verify.txt"; then
+                    verify="ok"
+                else
+                    verify="FAIL"
+                    echo "$config $mode: $(cat "$DIR/verify.txt")" >> "$DIR/failed"
+                fi
+                if [ "$mode_options" = "${mode_options#*-s 1}" ]; then
+                    fallocate=$(sed -n 's/.*extents with free pages \([0-9]*\).*/\1/p' "$DIR/report.txt")
+                else
+                    fallocate=$(sed -n 's/^Stage 1:.*extents \([0-9]*\).*/\1/p' "$DIR/report.txt")
+                fi
+                ;;
+            *)
+                fallocate=0
+                ;;
+        esac
+        #Syscalls are counted by separate run, strace slows it down
+        if [ -n "$STRACE" ]; then
+            prepare "$config"
+            # shellcheck disable=SC2086
+            "$STRACE" -f -c -o "$DIR/strace.txt" "$PLUCK" $pluck_options $mode_options -f "$DIR/work.fdb" > /dev/null 2>&1
+            syscalls=$(awk '$NF == "total" { print $4 }' "$DIR/strace.txt")
+            fallocate=$(awk '$NF == "fallocate" { print $4 }' "$DIR/strace.txt")
+        fi
+        awk -v config="$config" -v mode="$mode" -v pages="$PAGES" -v size="$size" -v start="$start" \
+            -v finish="$finish" -v syscalls="$syscalls" -v fallocate="${fallocate:-0}" -v verify="$verify" 'BEGIN {
+            seconds = finish - start
+            rate = seconds > 0 ? pages / seconds : 0
+            speed = seconds > 0 ? size / 1048576 / seconds : 0
+            printf "%-18s %-11s %9d %8.3f %11.0f %9.1f %9s %9s %6s\n", config, mode, pages, seconds, rate, speed,
+                   syscalls, fallocate, verify
+        }'
+    done
+done
+rm -f "$DIR/work.fdb" "$DIR/report.txt" "$DIR/strace.txt" "$DIR/verify.txt"
+if [ -f "$DIR/failed" ]; then
+    echo "Used data is changed by trim:"
+    cat "$DIR/failed"
+    rm -f "$DIR/failed"
+    exit 1
+fi
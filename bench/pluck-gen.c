@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fb_struct.h"
+
+//Generator of synthetic database files for pluck benchmarks.
+//Pages have valid headers, PIPs describe free pages, page fill is random in the given range.
+//Verify mode checks that trimmed file keeps all used data of the original file.
+
+#define DEFAULT_PAGES 32768
+#define DEFAULT_PAGE_SIZE 8192
+#define DEFAULT_ODS 12
+#define FIRST_ALLOCATED_RUN 64 //Pages after the first pip are allocated, as system relations of real databases
+#define MAX_RECORD_LENGTH 1024
+
+enum page_kind {
+    KIND_DATA,
+    KIND_BTREE,
+    KIND_BLOB,
+    KIND_OTHER,
+    KIND_COUNT
+};
+
+const char *kind_name[KIND_COUNT] = {"data", "b-tree", "blob", "other"};
+
+short goodbye = 0;
+char *db_filename = NULL;
+long pages_count = DEFAULT_PAGES;
+int page_size = DEFAULT_PAGE_SIZE;
+int ods = DEFAULT_ODS;
+double free_ratio = 0.3;
+int mix[KIND_COUNT] = {50, 25, 15, 10};
+int fill_low = 20;
+int fill_high = 100;
+double zero_ratio = 0;
+double hole_ratio = 0;
+unsigned long random_state = 1;
+char *verify_filename = NULL; //Original file, db_filename is its trimmed copy
+
+UCHAR *free_bits = NULL;
+UCHAR *hole_bits = NULL;
+long kind_pages[KIND_COUNT];
+long free_pages = 0;
+long hole_pages = 0;
+
+enum long_option {
+    OPT_PAGE_SIZE = 256,
+    OPT_ODS,
+    OPT_FREE,
+    OPT_MIX,
+    OPT_FILL,
+    OPT_ZERO,
+    OPT_HOLES,
+    OPT_SEED,
+    OPT_VERIFY,
+};
+
+void help(char *name) {
+    printf("Usage %s [options] -f database.fdb\n"
+           "Writes synthetic database file for pluck benchmarks\n"
+           "Available options:\n"
+           "\t-h help\n"
+           "\t-f database.fdb\n"
+           "\t-n pages count, default %d\n"
+           "\t--page-size page size 4096, 8192, 16384 or 32768, default %d\n"
+           "\t--ods on-disk structure 11, 12 or 13, default %d\n"
+           "\t--free percent of free pages in PIP, default 30\n"
+           "\t--mix percents of data, b-tree, blob and other pages, default 50,25,15,10\n"
+           "\t--fill range of used percent of data, b-tree and blob pages, uniform, default 20-100\n"
+           "\t--zero percent of pages with zeros in unused space, the rest have garbage, default 0\n"
+           "\t--holes percent of free runs punched already, default 0\n"
+           "\t--seed random seed, default 1\n"
+           "\t--verify original.fdb: check that -f trimmed copy keeps used data of original, changed bytes are zeros\n",
+           name, DEFAULT_PAGES, DEFAULT_PAGE_SIZE, DEFAULT_ODS);
+}
+
+int parse(int argc, char *argv[]) {
+    char *opts = "hf:n:";
+    const struct option long_opts[] = {
+            {"page-size", required_argument, NULL, OPT_PAGE_SIZE},
+            {"ods", required_argument, NULL, OPT_ODS},
+            {"free", required_argument, NULL, OPT_FREE},
+            {"mix", required_argument, NULL, OPT_MIX},
+            {"fill", required_argument, NULL, OPT_FILL},
+            {"zero", required_argument, NULL, OPT_ZERO},
+            {"holes", required_argument, NULL, OPT_HOLES},
+            {"seed", required_argument, NULL, OPT_SEED},
+            {"verify", required_argument, NULL, OPT_VERIFY},
+            {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, opts, long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                help(argv[0]);
+                goodbye = 1;
+                break;
+            case 'f':
+                db_filename = optarg;
+                break;
+            case 'n':
+                pages_count = strtol(optarg, NULL, 10);
+                if (pages_count < 3) {
+                    printf("Pages count must be at least 3\n");
+                    goodbye = 2;
+                }
+                break;
+            case OPT_PAGE_SIZE:
+                page_size = atoi(optarg);
+                if ((page_size != 4096) && (page_size != 8192) && (page_size != 16384) && (page_size != 32768)) {
+                    printf("Wrong page size %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_ODS:
+                ods = atoi(optarg);
+                if ((ods < 11) || (ods > 13)) {
+                    printf("ODS must be 11, 12 or 13\n");
+                    goodbye = 2;
+                }
+                break;
+            case OPT_FREE:
+                free_ratio = strtod(optarg, NULL) / 100;
+                if ((free_ratio < 0) || (free_ratio >= 1)) {
+                    printf("Free pages must be between 0 and 100 percent\n");
+                    goodbye = 2;
+                }
+                break;
+            case OPT_MIX:
+                if ((sscanf(optarg, "%d,%d,%d,%d", &mix[KIND_DATA], &mix[KIND_BTREE], &mix[KIND_BLOB],
+                            &mix[KIND_OTHER]) != KIND_COUNT) ||
+                    (mix[KIND_DATA] < 0) || (mix[KIND_BTREE] < 0) || (mix[KIND_BLOB] < 0) || (mix[KIND_OTHER] < 0) ||
+                    (mix[KIND_DATA] + mix[KIND_BTREE] + mix[KIND_BLOB] + mix[KIND_OTHER] == 0)) {
+                    printf("Wrong page mix %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_FILL:
+                if ((sscanf(optarg, "%d-%d", &fill_low, &fill_high) != 2) ||
+                    (fill_low < 0) || (fill_high > 100) || (fill_low > fill_high)) {
+                    printf("Wrong fill range %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_ZERO:
+                zero_ratio = strtod(optarg, NULL) / 100;
+                if ((zero_ratio < 0) || (zero_ratio > 1)) {
+                    printf("Pages with zeros must be between 0 and 100 percent\n");
+                    goodbye = 2;
+                }
+                break;
+            case OPT_HOLES:
+                hole_ratio = strtod(optarg, NULL) / 100;
+                if ((hole_ratio < 0) || (hole_ratio > 1)) {
+                    printf("Free runs in holes must be between 0 and 100 percent\n");
+                    goodbye = 2;
+                }
+                break;
+            case OPT_VERIFY:
+                verify_filename = optarg;
+                break;
+            case OPT_SEED:
+                random_state = strtoul(optarg, NULL, 10) * 0x9E3779B97F4A7C15UL + 1;
+                break;
+            default:
+                goodbye = 2;
+        }
+    }
+    return 0;
+}
+
+//xorshift64*
+unsigned long random_next(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DUL;
+}
+
+long random_below(long limit) {
+    return limit > 0 ? (long) (random_next() % (unsigned long) limit) : 0;
+}
+
+double random_unit(void) {
+    return (double) (random_next() >> 11) / (double) (1UL << 53);
+}
+
+void random_fill(char *buffer, long length) {
+    for (long i = 0; i < length; i += sizeof(unsigned long)) {
+        const unsigned long value = random_next();
+        memcpy(buffer + i, &value, length - i < (long) sizeof(unsigned long) ? length - i : (long) sizeof(unsigned long));
+    }
+}
+
+int is_bit(const UCHAR *bits, long page) {
+    return (bits[page / 8] >> (page % 8)) & 1;
+}
+
+void set_bit(UCHAR *bits, long page) {
+    bits[page / 8] |= 1 << (page % 8);
+}
+
+long pages_in_pip(void) {
+    return (long) (page_size - (ods == 11 ? offsetof(struct pip_page_ods11, bits) : offsetof(struct pip_page_ods12, bits))) * 8;
+}
+
+//Pip number N (from 1) describes pages [(N - 1) * pages_in_pip, N * pages_in_pip), next pip is the last page of range
+int is_pip(long page) {
+    return page == FIRST_PIP_PAGE || (page + 1) % pages_in_pip() == 0;
+}
+
+//Free runs of lengths from a few pages to thousands, allocated runs between them keep free_ratio
+void build_free_map(void) {
+    const long run_lengths[] = {1, 1, 2, 3, 4, 8, 16, 32, 64, 128, 256, 1024};
+    const int run_lengths_count = sizeof(run_lengths) / sizeof(run_lengths[0]);
+
+    for (long page = FIRST_ALLOCATED_RUN; free_ratio > 0 && page < pages_count;) {
+        const long length = run_lengths[random_below(run_lengths_count)];
+        const int hole = random_unit() < hole_ratio;
+        for (long free_page = page; free_page < page + length && free_page < pages_count; free_page++) {
+            if (is_pip(free_page))
+                continue;
+            set_bit(free_bits, free_page);
+            free_pages++;
+            if (hole) {
+                set_bit(hole_bits, free_page);
+                hole_pages++;
+            }
+        }
+        page += length;
+        page += 1 + random_below((long) (2 * (double) length * (1 - free_ratio) / free_ratio));
+    }
+}
+
+void page_header_init(char *page, SCHAR page_type) {
+    struct page_header *header = (struct page_header *) page;
+    header->page_type = page_type;
+    header->page_flags = 0;
+    header->pag_checksum = 12345;
+    header->pag_generation = (ULONG) (1 + random_below(1000000));
+    header->pag_scn = ods == 11 ? 0 : (ULONG) (1 + random_below(1000));
+    header->reserved = 0;
+}
+
+//Unused space of page: zeros or garbage of deleted records
+void unused_fill(char *page, long offset, long length, int zero) {
+    if (zero)
+        memset(page + offset, 0, length);
+    else
+        random_fill(page + offset, length);
+}
+
+long used_length(long length) {
+    return length * (fill_low + random_below(fill_high - fill_low + 1)) / 100;
+}
+
+//Records are placed from the end of page down, as Firebird does, deleted records have empty slots
+void data_page_build(char *page, int zero) {
+    struct data_page *data_page = (struct data_page *) page;
+    const long used = used_length(page_size);
+    long top = page_size;
+    long stored = 0;
+    unsigned short count = 0;
+
+    unused_fill(page, 0, page_size, zero);
+    page_header_init(page, PT_DATA);
+    data_page->dpg_sequence = (ULONG) random_below(100000);
+    data_page->relation = (USHORT) (128 + random_below(100));
+    while (stored < used) {
+        const long rpt_end = (long) (offsetof(struct data_page, dpg_rpt) + sizeof(struct dpg_repeat) * (count + 1));
+        long length = 16 + random_below(MAX_RECORD_LENGTH);
+        if (length > used - stored)
+            length = used - stored;
+        if (top - length < rpt_end)
+            break;
+        if (random_below(100) < 15) {
+            data_page->dpg_rpt[count].dpg_offset = 0;
+            data_page->dpg_rpt[count].dpg_length = 0;
+        } else {
+            top -= length;
+            stored += length;
+            data_page->dpg_rpt[count].dpg_offset = (USHORT) top;
+            data_page->dpg_rpt[count].dpg_length = (USHORT) length;
+            random_fill(page + top, length);
+        }
+        count++;
+    }
+    data_page->count = count;
+}
+
+void btree_page_build(char *page, int zero) {
+    struct btree_page *btree_page = (struct btree_page *) page;
+    long length = used_length(page_size);
+
+    if (length < (long) sizeof(struct btree_page))
+        length = sizeof(struct btree_page);
+    if (length > page_size - 1)
+        length = page_size - 1;
+    unused_fill(page, length, page_size - length, zero);
+    random_fill(page, length);
+    page_header_init(page, PT_B_TREE);
+    btree_page->btr_sibling = (SLONG) random_below(pages_count);
+    btree_page->btr_left_sibling = (SLONG) random_below(pages_count);
+    btree_page->btr_prefix_total = 0;
+    btree_page->btr_relation = (USHORT) (128 + random_below(100));
+    btree_page->btr_length = (USHORT) length;
+    btree_page->btr_id = (UCHAR) random_below(8);
+    btree_page->btr_level = (UCHAR) (random_below(10) == 0);
+}
+
+void blob_page_build(char *page, int zero) {
+    struct blob_page *blob_page = (struct blob_page *) page;
+    const long length = used_length(page_size - (long) offsetof(struct blob_page, blp_page));
+    const long finish = (long) offsetof(struct blob_page, blp_page) + length;
+
+    unused_fill(page, finish, page_size - finish, zero);
+    random_fill(page, finish);
+    page_header_init(page, PT_BLOB);
+    blob_page->blp_lead_page = (ULONG) random_below(pages_count);
+    blob_page->blp_sequence = (ULONG) random_below(1000);
+    blob_page->blp_length = (USHORT) length;
+    blob_page->blp_pad = 0;
+}
+
+//Pages not analyzed by stage 2: TIP, pointer, index root, generator and undefined pages
+void other_page_build(char *page, int zero) {
+    const SCHAR page_types[] = {PT_TRANSACTION_INVENTORY, PT_POINTER_PAGE, PT_INDEX_ROOT, PT_GENERATOR,
+                                PT_UNDEFINED_PAGE};
+    const SCHAR page_type = page_types[random_below(sizeof(page_types))];
+
+    if (page_type == PT_UNDEFINED_PAGE) {
+        memset(page, 0, page_size);
+        return;
+    }
+    random_fill(page, page_size / 2);
+    unused_fill(page, page_size / 2, page_size - page_size / 2, zero);
+    page_header_init(page, page_type);
+}
+
+void header_page_build(char *page) {
+    struct header_page *header = (struct header_page *) page;
+    const USHORT ods_versions[] = {0x800B, 0x800C, 0x800D};
+
+    memset(page, 0, page_size);
+    page_header_init(page, PT_HEADER);
+    header->hdr_page_size = (USHORT) page_size;
+    header->hdr_ods_version = ods_versions[ods - 11];
+    header->hdr_next_transaction = 1000;
+    //Full shutdown, so the file can be trimmed
+    header->hdr_flags = hdr_shutdown_full;
+}
+
+void pip_page_build(char *page, long first_page) {
+    const long bits_count = pages_in_pip();
+    UCHAR *bits;
+
+    memset(page, 0, page_size);
+    page_header_init(page, PT_PAGE_INVENTORY);
+    if (ods == 11)
+        bits = (UCHAR *) page + offsetof(struct pip_page_ods11, bits);
+    else
+        bits = (UCHAR *) page + offsetof(struct pip_page_ods12, bits);
+    //Pages after the end of file are free
+    for (long bit = 0; bit < bits_count; bit++) {
+        const long page_num = first_page + bit;
+        if (page_num >= pages_count || is_bit(free_bits, page_num))
+            bits[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+//Bytes of page used by database: records and dpg_rpt array of data page, btr_length of b-tree page,
+//blob data, whole page of other types. Bit per byte is set in used.
+void page_used_bytes(const char *page, UCHAR *used) {
+    const struct page_header *header = (const struct page_header *) page;
+    long length = page_size;
+
+    memset(used, 0, page_size / 8);
+    if (header->page_type == PT_DATA) {
+        const struct data_page *data_page = (const struct data_page *) page;
+        length = (long) (offsetof(struct data_page, dpg_rpt) + sizeof(struct dpg_repeat) * data_page->count);
+        if (length > page_size)
+            length = page_size;
+        for (long cnt = 0; length < page_size && cnt < data_page->count; cnt++) {
+            const long offset = data_page->dpg_rpt[cnt].dpg_offset;
+            const long finish = offset + data_page->dpg_rpt[cnt].dpg_length;
+            for (long byte = offset; byte < finish && byte < page_size; byte++) {
+                set_bit(used, byte);
+            }
+        }
+    } else if (header->page_type == PT_B_TREE) {
+        length = ((const struct btree_page *) page)->btr_length;
+    } else if (header->page_type == PT_BLOB) {
+        length = (long) offsetof(struct blob_page, blp_page) + ((const struct blob_page *) page)->blp_length;
+    }
+    for (long byte = 0; byte < length && byte < page_size; byte++) {
+        set_bit(used, byte);
+    }
+}
+
+//Verify trimmed copy: used bytes of pages allocated in PIP are the same, changed bytes are zeros
+int verify(void) {
+    const USHORT ods_versions[] = {0x800B, 0x800C, 0x800D};
+    struct header_page header;
+    struct stat original_stat;
+    const UCHAR *pip_bits = NULL;
+    long pip_first = 0;
+    long used_changed = 0;
+    long not_zero = 0;
+    long pages_checked = 0;
+
+    const int fd_original = open(verify_filename, O_RDONLY);
+    const int fd_trimmed = open(db_filename, O_RDONLY);
+    if (fd_original < 0 || fd_trimmed < 0 || fstat(fd_original, &original_stat) != 0 ||
+        pread(fd_original, &header, sizeof(header), 0) != sizeof(header)) {
+        fprintf(stderr, "Error read files %s and %s\n", verify_filename, db_filename);
+        return 1;
+    }
+    page_size = header.hdr_page_size;
+    for (ods = 11; ods <= 13 && ods_versions[ods - 11] != header.hdr_ods_version; ods++);
+    pages_count = original_stat.st_size / page_size;
+    char *original = malloc(page_size);
+    char *trimmed = malloc(page_size);
+    char *pip = malloc(page_size);
+    UCHAR *used = malloc(page_size / 8);
+    if (ods > 13 || original == NULL || trimmed == NULL || pip == NULL || used == NULL) {
+        fprintf(stderr, "Unsupported page size %d or ODS %x\n", page_size, header.hdr_ods_version);
+        return 1;
+    }
+    for (long page_num = 0; page_num < pages_count; page_num++) {
+        if (pread(fd_original, original, page_size, page_num * page_size) != page_size ||
+            pread(fd_trimmed, trimmed, page_size, page_num * page_size) != page_size) {
+            fprintf(stderr, "Error read page %ld\n", page_num);
+            return 1;
+        }
+        //Pip describes the pages after it, the first pip describes pages from 0
+        if (is_pip(page_num)) {
+            memcpy(pip, original, page_size);
+            pip_bits = (UCHAR *) pip + (ods == 11 ? offsetof(struct pip_page_ods11, bits) : offsetof(struct pip_page_ods12, bits));
+            pip_first = page_num == FIRST_PIP_PAGE ? 0 : page_num + 1;
+        }
+        const int is_free = pip_bits && page_num >= pip_first && is_bit(pip_bits, page_num - pip_first) && !is_pip(page_num);
+        if (is_free)
+            memset(used, 0, page_size / 8);
+        else
+            page_used_bytes(original, used);
+        for (long byte = 0; byte < page_size; byte++) {
+            if (original[byte] == trimmed[byte])
+                continue;
+            if (is_bit(used, byte))
+                used_changed++;
+            else if (trimmed[byte] != 0)
+                not_zero++;
+        }
+        pages_checked++;
+    }
+    close(fd_original);
+    close(fd_trimmed);
+    free(original);
+    free(trimmed);
+    free(pip);
+    free(used);
+    printf("Verified pages %ld, changed used bytes %ld, changed unused bytes not zero %ld\n",
+           pages_checked, used_changed, not_zero);
+    return used_changed || not_zero ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *page;
+    int fd;
+    int mix_total;
+
+    parse(argc, argv);
+    if (goodbye > 0)
+        return goodbye - 1;
+    if (!db_filename) {
+        help(argv[0]);
+        return 0;
+    }
+    if (verify_filename)
+        return verify();
+    mix_total = mix[KIND_DATA] + mix[KIND_BTREE] + mix[KIND_BLOB] + mix[KIND_OTHER];
+    page = malloc(page_size);
+    free_bits = calloc((pages_count + 7) / 8, 1);
+    hole_bits = calloc((pages_count + 7) / 8, 1);
+    if (page == NULL || free_bits == NULL || hole_bits == NULL) {
+        fprintf(stderr, "Error allocating memory\n");
+        return 1;
+    }
+    fd = open(db_filename, O_CREAT | O_TRUNC | O_WRONLY, 00660);
+    if (fd < 0) {
+        fprintf(stderr, "Error %d open file %s\n", fd, db_filename);
+        return 1;
+    }
+    build_free_map();
+
+    for (long page_num = 0; page_num < pages_count; page_num++) {
+        //Punched free pages are not written, they are holes of file
+        if (is_bit(hole_bits, page_num))
+            continue;
+        const int zero = random_unit() < zero_ratio;
+        if (page_num == 0) {
+            header_page_build(page);
+        } else if (is_pip(page_num)) {
+            pip_page_build(page, page_num == FIRST_PIP_PAGE ? 0 : page_num + 1);
+        } else if (is_bit(free_bits, page_num)) {
+            //Released page keeps its old content or zeros
+            if (random_below(100) < 30)
+                memset(page, 0, page_size);
+            else
+                data_page_build(page, zero);
+        } else {
+            long kind = random_below(mix_total);
+            int kind_num = 0;
+            while (kind >= mix[kind_num]) {
+                kind -= mix[kind_num];
+                kind_num++;
+            }
+            kind_pages[kind_num]++;
+            switch (kind_num) {
+                case KIND_DATA:
+                    data_page_build(page, zero);
+                    break;
+                case KIND_BTREE:
+                    btree_page_build(page, zero);
+                    break;
+                case KIND_BLOB:
+                    blob_page_build(page, zero);
+                    break;
+                default:
+                    other_page_build(page, zero);
+            }
+        }
+        if (pwrite(fd, page, page_size, page_num * page_size) != page_size) {
+            fprintf(stderr, "Error write page %ld\n", page_num);
+            close(fd);
+            return 1;
+        }
+    }
+    if (ftruncate(fd, pages_count * page_size)) {
+        fprintf(stderr, "Error set size of file %s\n", db_filename);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    free(page);
+    free(free_bits);
+    free(hole_bits);
+
+    printf("Pages %ld, page size %d, ODS %d, free %ld, in holes %ld", pages_count, page_size, ods, free_pages, hole_pages);
+    for (int kind_num = 0; kind_num < KIND_COUNT; kind_num++) {
+        printf(", %s %ld", kind_name[kind_num], kind_pages[kind_num]);
+    }
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,3 @@
+#define pluck_VERSION "0.2.3"
+#define COMMIT_HASH "9b63ca6509614ef4d227b3e8df81fe4f351d4d09"
+
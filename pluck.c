@@ -1,14 +1,37 @@
 #include <stdio.h>
 #include <stddef.h>
+#include <limits.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <malloc.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <time.h>
 
 #include <linux/falloc.h>
 #include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <math.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "fb_struct.h"
 #include "commit.h"
@@ -21,10 +44,11 @@
 #define ERR_DB_ENCRYPTED 5
 #define ERR_INCMP 6
 #define ERR_MUTEX 7
+#define ERR_MEM 8
 
 #define MAX_THREADS 128
 
-#define VER_STATUS_FILE 1
+#define VER_STATUS_FILE 2
 
 #define MAX_SUPPORTED_ODS 6
 const unsigned short supported_ods[MAX_SUPPORTED_ODS] = {
@@ -48,21 +72,77 @@ const char *supported_db[MAX_SUPPORTED_ODS] = {
 short goodbye = 0;
 #define DEFAULT_BLOCK_SIZE 4096
 short block_size = DEFAULT_BLOCK_SIZE;
+#define DEFAULT_READ_CHUNK_SIZE 1048576
+#define MAX_READ_CHUNK_SIZE 268435456
+#define READ_CHUNK_ALIGN 4096
+long read_chunk_size = DEFAULT_READ_CHUNK_SIZE;
+short use_io_uring = 0;
+#define DEFAULT_IO_URING_DEPTH 8
+#define MAX_IO_URING_DEPTH 64
+int io_uring_depth = DEFAULT_IO_URING_DEPTH;
+short probe_pages = 0; //Read only the first block of page on stage 2
+#define PROBE_PREAD_MIN_BLOCKS 8 //pread probes by page only when page has this count of blocks or more
+short verify_pages = 0; //Read whole probed page before trim
+short direct_io = 0; //Stage 2 reads with O_DIRECT
+short drop_cache = 0; //Buffered stage 2 reads, read chunks are dropped from page cache
+#define DEFAULT_LOGICAL_BLOCK_SIZE 512
 #define DEFAULT_PROGRESS_BAR_STEP 16777216
 int progress_bar_step = 0;
 short trim = 0; //Default dry-run
 short stage = 2;
 int threads_count = 1;
+short threads_count_set = 0; //-p is set, otherwise threads count is taken from status file
 short log_level = 1;
 char *db_filename;
 int fd;
+int fd_read; //Stage 2 reads, opened with O_DIRECT in direct mode
 long total_pages;
 struct header_page header_page;
 long pages_for_trim = 0;
+long extents_for_trim = 0;
+short stage1_trim_deferred = 0; //Free pages are trimmed by stage 2 threads, joined with free blocks of pages
+long max_extent_size = 0; //Max bytes per one fallocate call on stage 1, 0 - unlimited
+//Punch policy against file fragmentation, applied to every fallocate call
+long min_hole_size = 0; //Shorter ranges are not trimmed
+long punch_align = 0; //Only aligned part of range is trimmed
+long max_extents_per_gib = 0; //Max trimmed ranges per GiB of file
+long *gib_extents = NULL; //Trimmed ranges by GiB of file, shared by threads
+long file_extents_before = -1; //FIEMAP extents of file, -1 if FIEMAP is not supported
+long file_extents_after = -1;
+//Runs of free pages found on stage 1, sorted by start page
+struct page_run {
+    long start;
+    long length;
+};
+struct page_run *free_runs = NULL;
+long free_runs_count = 0;
+long free_runs_allocated = 0;
+//Holes of database file in whole pages found by SEEK_HOLE, sorted by start page.
+//Pages in holes are not read and not trimmed again.
+struct page_run *holes = NULL;
+long holes_count = 0;
+long holes_allocated = 0;
+long hole_pages = 0;
+long free_pages_in_holes = 0;
 long blocks_for_trim = 0;
+//Deadline mode: free runs of stage 1 are trimmed from the longest one, stage 2 tasks are taken
+//in order of estimated free blocks per read page. No new run or task is started after the deadline.
+long deadline = 0;
+long deadline_time = 0;
+short deadline_reached = 0;
+struct page_run *trim_runs = NULL;
+long trim_runs_count = 0;
+long trim_runs_allocated = 0;
+long stage1_pages_trimmed = 0;
+long *task_order = NULL;
+long estimated_blocks = 0;
+//Sample mode: stage 2 is estimated by random pages of every task instead of reading all pages
+#define DEFAULT_SAMPLE_PERCENT 0.1
+double sample_percent = 0;
+double sample_error = 0;
 char *status_filename;
 int fd_status_file = 0;
-int ver_status_file = VER_STATUS_FILE;
+//State of stage 2 thread, range of the current task
 struct status {
     int thread_number;
     int error;
@@ -70,10 +150,214 @@ struct status {
     long finish;
     long position;
     long blocks_for_trim;
+    ULONG max_scn; //Max SCN of pages read in the current task
 };
 struct status stage2_status[MAX_THREADS];
+//Status file: two copies of checkpoint, each is header, then blocks for trim of every task,
+//TASK_NOT_DONE for task not done yet, then the first page of every task moved by task_start().
+//Checkpoint is written over the older copy,
+//so the newer one stays valid if writing is interrupted.
+#define STATUS_FILE_MAGIC "PLUCKST"
+struct status_file_header {
+    char magic[8];
+    int version;
+    int threads_count;
+    long sequence;
+    long total_pages;
+    long task_pages;
+    long tasks_count;
+    USHORT page_size;
+    USHORT block_size;
+    int trim;
+    unsigned long checksum; //FNV-1a of copy with zero checksum
+};
+#define DEFAULT_CHECKPOINT_PAGES 1048576
+#define DEFAULT_CHECKPOINT_INTERVAL 10
+long checkpoint_pages = DEFAULT_CHECKPOINT_PAGES;
+int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+long checkpoint_sequence = 0;
+long checkpoint_pending_pages = 0; //Pages of tasks done after the last checkpoint
+long checkpoint_time = 0;
+char *checkpoint_buffer = NULL;
+pthread_mutex_t mutex_checkpoint = PTHREAD_MUTEX_INITIALIZER;
+//Stage 2 is split into tasks of fixed size, threads take them from the shared cursor next_task
+#define TASK_SIZE 67108864
+#define TASK_NOT_DONE (-1)
+long task_pages;
+long tasks_count;
+long next_task = 0;
+long tasks_done = 0;
+long *task_blocks = NULL;
+//Manifest of the last full stage 2 with trim: max SCN of pages and max SCN of every task.
+//Incremental stage 2 skips pages with SCN less than max SCN of manifest, they are not changed after it.
+#define MANIFEST_MAGIC "PLUCKMF"
+#define VER_MANIFEST_FILE 1
+struct manifest_header {
+    char magic[8];
+    int version;
+    USHORT page_size;
+    USHORT ods_version;
+    long total_pages;
+    long task_pages;
+    long tasks_count;
+    ULONG max_scn;
+    USHORT block_size;
+    USHORT trim; //Manifest is saved by trim run only, blocks of skipped pages are trimmed
+    unsigned long checksum; //FNV-1a of file with zero checksum
+};
+char *manifest_filename = NULL;
+short incremental = 0;
+ULONG manifest_scn = 0; //Pages with lesser SCN are skipped in incremental mode, 0 - nothing is skipped
+ULONG *manifest_task_scn = NULL; //Max SCN of tasks from manifest
+long manifest_tasks_count = 0;
+ULONG *task_scn = NULL; //Max SCN of tasks in the current run
+//Punch plan: dry run saves free blocks of pages with their generation,
+//apply mode checks page headers and trims the blocks without reading and analyzing pages
+#define PLAN_MAGIC "PLUCKPL"
+#define VER_PLAN_FILE 1
+struct plan_header {
+    char magic[8];
+    int version;
+    USHORT page_size;
+    USHORT block_size;
+    USHORT ods_version;
+    USHORT reserved;
+    long total_pages;
+    long pages_count;
+    unsigned long checksum; //FNV-1a of file with zero checksum
+};
+struct plan_page {
+    ULONG page_num;
+    ULONG generation;
+    ULONG scn;
+    SCHAR page_type;
+    UCHAR reserved[3];
+    unsigned long free_bits; //Bit set for free block
+};
+//Pages of plan found by one stage 2 thread
+struct plan_pages {
+    struct plan_page *pages;
+    long count;
+    long allocated;
+};
+char *plan_save_filename = NULL;
+char *plan_apply_filename = NULL;
+struct plan_pages plan_thread[MAX_THREADS];
+//Counters of stage 2 threads, not saved in status file.
+//Every thread writes only its own counters, progress reporter reads them without locks.
+//Latency histogram: bucket N counts calls up to 2^N microseconds, the last bucket counts the rest
+#define LATENCY_BUCKETS 24
+struct latency_histogram {
+    long count[LATENCY_BUCKETS];
+    long calls;
+    double seconds;
+};
+//Data pages of relation or b-tree pages of index, aggregated by stage 2 threads
+#define OBJECT_FILL_BUCKETS 10 //Fill histogram by 10%
+#define OBJECT_INDEX 0x8000 //Key of index is relation << 16 | OBJECT_INDEX | btr_id
+struct object_stats {
+    ULONG key;
+    long pages; //0 for empty slot
+    long used_bytes; //Bytes of records and dpg_rpt array of data pages, btr_length of b-tree pages
+    long free_blocks; //Blocks for trim
+    long fill[OBJECT_FILL_BUCKETS];
+};
+//Open addressing hash table, size is power of 2
+struct object_table {
+    struct object_stats *slots;
+    long count;
+    long size;
+};
+short objects_enabled = 0;
+struct object_table objects_total; //Tables of threads merged after stage 2
+struct stage2_stats {
+    long pages_done; //Pages of processed ranges, read and free
+    long pages_read;
+    long pages_hole; //Allocated pages in holes, not read
+    long pages_unchanged; //Pages skipped by SCN in incremental mode
+    long bytes_read;
+    long blocks; //Blocks for trim found
+    long extents;
+    //Fields below are read after the thread is joined
+    long page_type_blocks[MAX_PAGE_TYPE + 1]; //Blocks for trim found by page type, before punch policy
+    long trimmed_bytes; //Bytes passed to fallocate
+    double busy_seconds; //Time of tasks
+    struct latency_histogram read_latency;
+    struct latency_histogram fallocate_latency;
+    struct object_table objects;
+    long policy_extents; //Ranges kept by punch policy
+    long policy_bytes; //Bytes kept by punch policy, with unaligned parts of trimmed ranges
+};
+struct stage2_stats stage2_stats[MAX_THREADS];
+struct stage2_stats main_stats; //Stage 1 and plan of main thread
+//Metrics of run, written at the end in JSON and in Prometheus text format
+char *metrics_filename = NULL;
+char *metrics_prom_filename = NULL;
+struct timespec run_started;
+double stage1_seconds = 0;
+double stage2_seconds = 0;
+int stage2_threads = 0; //Threads of stage 2 started
 pthread_t stage2_thread_id[MAX_THREADS];
-pthread_mutex_t mutex_stdout = PTHREAD_MUTEX_INITIALIZER;
+//Progress reporter of stage 2
+#define PROGRESS_INTERVAL_MS 500
+long progress_resumed_pages = 0; //Pages of tasks done by previous runs
+short progress_stop = 0;
+pthread_t progress_thread_id;
+pthread_mutex_t mutex_progress = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_progress = PTHREAD_COND_INITIALIZER;
+//Asynchronous log of level 3: every thread writes binary records into its own ring,
+//log writer thread formats them into log_filename or stdout
+#define LOG_RING_SIZE 4096 //Records, power of 2
+#define LOG_WRITER_SLEEP_US 1000
+enum {
+    LOG_TRIM_PAGES,
+    LOG_TRIM_OFFSET,
+    LOG_PAGE_BITMAP,
+};
+struct log_record {
+    int event;
+    int page_type;
+    long value1;
+    long value2;
+    long value3;
+};
+struct log_ring {
+    long head; //Written only by owner thread
+    char head_pad[56];
+    long tail; //Written only by log writer
+    char tail_pad[56];
+    struct log_record records[LOG_RING_SIZE];
+};
+struct log_ring *log_rings[MAX_THREADS + 1]; //0 - main thread, N + 1 - stage 2 thread N
+char *log_filename = NULL;
+FILE *log_file = NULL;
+short log_stop = 0;
+short log_writer_started = 0;
+pthread_t log_thread_id;
+//Limits of I/O shared by all threads, token bucket with burst of one second, rate 0 - unlimited.
+//Limits are changed at runtime by control file, it is read on SIGHUP or when it is modified.
+struct token_bucket {
+    double rate; //Tokens per second
+    double tokens;
+    struct timespec updated;
+};
+struct token_bucket read_limit; //Bytes per second
+struct token_bucket punch_limit; //fallocate calls per second
+struct token_bucket discard_limit; //Bytes per second
+short limits_enabled = 0;
+pthread_mutex_t mutex_limits = PTHREAD_MUTEX_INITIALIZER;
+char *control_filename = NULL;
+time_t control_mtime = 0;
+long control_checked = 0;
+volatile sig_atomic_t control_reload = 0;
+short io_idle = 0;
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE 3
+#endif
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS 1
+#endif
+#define IOPRIO_CLASS_SHIFT_ 13
 
 int is_supported_ods() {
     for (short i = 0; i < MAX_SUPPORTED_ODS; i++) {
@@ -125,10 +409,43 @@ void help(char *name) {
            "\t\tstage 1 - search for free page using PIP\n"
            "\t\tstage 2 - stage 1, then search for unused blocks on pages\n"
            "\t-p parallel threads on stage 2, between 1 and %d\n"
-           "\t-P print progress bar, step 16 MiB\n"
-           "\t-S status filename\n"
+           "\t-P print progress bar\n"
+           "\t-S status filename, run is continued from it by any threads count\n"
            "\t-d log level 0-3, default 1\n"
-           "\t-f database.fdb\n", name, MAX_THREADS);
+           "\t-f database.fdb\n"
+           "\t--max-extent max size in MiB of one trimmed extent, default unlimited\n"
+           "\t--read-chunk size in MiB of one read on stage 2, between 1 and %d, default %d\n"
+           "\t--io-uring use io_uring on stage 2, if it is available\n"
+           "\t--io-depth reads in flight per thread with io_uring, between 1 and %d, default %d\n"
+           "\t--probe read only the first block of page on stage 2, and dpg_rpt array of data page\n"
+           "\t--verify read whole probed page before trim\n"
+           "\t--checkpoint-pages save status file after this count of pages, default %d\n"
+           "\t--checkpoint-interval save status file after this count of seconds, default %d\n"
+           "\t--log-file file for messages of log level 3, default stdout\n"
+           "\t--read-limit max read speed in MiB/s, default unlimited\n"
+           "\t--punch-limit max fallocate calls per second, default unlimited\n"
+           "\t--discard-limit max trimmed MiB/s, default unlimited\n"
+           "\t--control file with lines \"read-limit N\", \"punch-limit N\", \"discard-limit N\",\n"
+           "\t\tread on SIGHUP and when it is modified\n"
+           "\t--idle run with idle I/O priority\n"
+           "\t--direct read pages on stage 2 with O_DIRECT, or drop them from page cache if it isn't supported\n"
+           "\t--manifest file with max page SCN, saved after full stage 2 on ODS12 and newer\n"
+           "\t--incremental skip pages with SCN less than in manifest, use with --probe to read only headers\n"
+           "\t--plan-save save free blocks of pages to plan file in dry run\n"
+           "\t--plan-apply trim free pages and free blocks of unchanged pages from plan file, without stage 2\n"
+           "\t--deadline seconds for run: the longest free runs are trimmed first, then stage 2 tasks\n"
+           "\t\twith the most free blocks per read page, no new work is started after it\n"
+           "\t--sample estimate free blocks of stage 2 by random sample of this percent of pages, default %g\n"
+           "\t--sample-error estimate by sample, which is grown until this percent of relative error\n"
+           "\t--metrics file for metrics of run in JSON\n"
+           "\t--metrics-prom file for metrics of run in Prometheus text format, for node_exporter textfile collector\n"
+           "\t--objects report pages, fill and free space of every relation and index in dry run of stage 2\n"
+           "\t--min-hole min size in KiB of trimmed range, shorter ranges are kept, default 0\n"
+           "\t--align trim only parts of ranges aligned to this size in KiB, multiple of block size\n"
+           "\t--max-extents-per-gib max trimmed ranges per GiB of file, the next ranges of this GiB are kept\n",
+           name, MAX_THREADS, MAX_READ_CHUNK_SIZE / 1048576, DEFAULT_READ_CHUNK_SIZE / 1048576,
+           MAX_IO_URING_DEPTH, DEFAULT_IO_URING_DEPTH, DEFAULT_CHECKPOINT_PAGES, DEFAULT_CHECKPOINT_INTERVAL,
+           DEFAULT_SAMPLE_PERCENT);
 }
 
 void version(char *name) {
@@ -139,10 +456,113 @@ void version(char *name) {
     }
 }
 
+//Set limit by name of option, MiB/s for bytes
+int limit_set(const char *name, const char *value) {
+    char *end;
+    const double rate = strtod(value, &end);
+
+    struct token_bucket *bucket;
+
+    if (end == value || *end != '\0' || !isfinite(rate) || rate < 0)
+        return 1;
+    if (strcmp(name, "read-limit") == 0)
+        bucket = &read_limit;
+    else if (strcmp(name, "punch-limit") == 0)
+        bucket = &punch_limit;
+    else if (strcmp(name, "discard-limit") == 0)
+        bucket = &discard_limit;
+    else
+        return 1;
+    //Debt of the old limit is dropped
+    bucket->rate = bucket == &punch_limit ? rate : rate * 1048576;
+    bucket->tokens = 0;
+    if (rate > 0)
+        limits_enabled = 1;
+    return 0;
+}
+
+//Whole option value must be a number between min and max, number gets it multiplied by scale.
+//Returns 1 if value is wrong.
+int parse_long(const char *value, long min, long max, long scale, long *number) {
+    char *end;
+
+    errno = 0;
+    const long result = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || result < min || result > max)
+        return 1;
+    *number = result * scale;
+    return 0;
+}
+
+//Codes of long options without short equivalent
+enum {
+    OPT_MAX_EXTENT = 256,
+    OPT_READ_CHUNK,
+    OPT_IO_URING,
+    OPT_IO_DEPTH,
+    OPT_PROBE,
+    OPT_VERIFY,
+    OPT_CHECKPOINT_PAGES,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_LOG_FILE,
+    OPT_READ_LIMIT,
+    OPT_PUNCH_LIMIT,
+    OPT_DISCARD_LIMIT,
+    OPT_CONTROL,
+    OPT_IDLE,
+    OPT_DIRECT,
+    OPT_MANIFEST,
+    OPT_INCREMENTAL,
+    OPT_PLAN_SAVE,
+    OPT_PLAN_APPLY,
+    OPT_DEADLINE,
+    OPT_SAMPLE,
+    OPT_SAMPLE_ERROR,
+    OPT_METRICS,
+    OPT_METRICS_PROM,
+    OPT_OBJECTS,
+    OPT_MIN_HOLE,
+    OPT_ALIGN,
+    OPT_MAX_EXTENTS_PER_GIB,
+};
+
 int parse(int argc, char *argv[]) {
     char *opts = "hvtb:d:f:s:p:PS:";
+    const struct option long_opts[] = {
+            {"max-extent", required_argument, NULL, OPT_MAX_EXTENT},
+            {"read-chunk", required_argument, NULL, OPT_READ_CHUNK},
+            {"io-uring", no_argument, NULL, OPT_IO_URING},
+            {"io-depth", required_argument, NULL, OPT_IO_DEPTH},
+            {"probe", no_argument, NULL, OPT_PROBE},
+            {"verify", no_argument, NULL, OPT_VERIFY},
+            {"checkpoint-pages", required_argument, NULL, OPT_CHECKPOINT_PAGES},
+            {"checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+            {"log-file", required_argument, NULL, OPT_LOG_FILE},
+            {"read-limit", required_argument, NULL, OPT_READ_LIMIT},
+            {"punch-limit", required_argument, NULL, OPT_PUNCH_LIMIT},
+            {"discard-limit", required_argument, NULL, OPT_DISCARD_LIMIT},
+            {"control", required_argument, NULL, OPT_CONTROL},
+            {"idle", no_argument, NULL, OPT_IDLE},
+            {"direct", no_argument, NULL, OPT_DIRECT},
+            {"manifest", required_argument, NULL, OPT_MANIFEST},
+            {"incremental", no_argument, NULL, OPT_INCREMENTAL},
+            {"plan-save", required_argument, NULL, OPT_PLAN_SAVE},
+            {"plan-apply", required_argument, NULL, OPT_PLAN_APPLY},
+            {"deadline", required_argument, NULL, OPT_DEADLINE},
+            {"sample", required_argument, NULL, OPT_SAMPLE},
+            {"sample-error", required_argument, NULL, OPT_SAMPLE_ERROR},
+            {"metrics", required_argument, NULL, OPT_METRICS},
+            {"metrics-prom", required_argument, NULL, OPT_METRICS_PROM},
+            {"objects", no_argument, NULL, OPT_OBJECTS},
+            {"min-hole", required_argument, NULL, OPT_MIN_HOLE},
+            {"align", required_argument, NULL, OPT_ALIGN},
+            {"max-extents-per-gib", required_argument, NULL, OPT_MAX_EXTENTS_PER_GIB},
+            {NULL, 0, NULL, 0}
+    };
     int opt;
-    while ((opt = getopt(argc, argv, opts)) != -1) {
+    long number;
+    char *end;
+    while ((opt = getopt_long(argc, argv, opts, long_opts, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 help(argv[0]);
@@ -178,6 +598,7 @@ int parse(int argc, char *argv[]) {
                 break;
             case 'p':
                 threads_count = atoi(optarg);
+                threads_count_set = 1;
                 if ((threads_count < 1) || (threads_count > MAX_THREADS)){
                     printf("Threads count must be between 1 and %d\n", MAX_THREADS);
                     goodbye = 2;
@@ -189,6 +610,130 @@ int parse(int argc, char *argv[]) {
             case 'S':
                 status_filename = optarg;
                 break;
+            case OPT_MAX_EXTENT:
+                if (parse_long(optarg, 1, LONG_MAX / 1048576, 1048576, &max_extent_size)) {
+                    printf("Wrong max extent size %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_READ_CHUNK:
+                if (parse_long(optarg, 1, MAX_READ_CHUNK_SIZE / 1048576, 1048576, &read_chunk_size)) {
+                    printf("Read chunk size must be between 1 and %d MiB\n", MAX_READ_CHUNK_SIZE / 1048576);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_IO_URING:
+                use_io_uring = 1;
+                break;
+            case OPT_IO_DEPTH:
+                if (parse_long(optarg, 1, MAX_IO_URING_DEPTH, 1, &number) == 0) {
+                    io_uring_depth = (int) number;
+                } else {
+                    printf("io_uring depth must be between 1 and %d\n", MAX_IO_URING_DEPTH);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_PROBE:
+                probe_pages = 1;
+                break;
+            case OPT_VERIFY:
+                verify_pages = 1;
+                break;
+            case OPT_CHECKPOINT_PAGES:
+                if (parse_long(optarg, 1, LONG_MAX, 1, &checkpoint_pages)) {
+                    printf("Wrong checkpoint pages %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_CHECKPOINT_INTERVAL:
+                if (parse_long(optarg, 0, INT_MAX, 1, &number) == 0) {
+                    checkpoint_interval = (int) number;
+                } else {
+                    printf("Wrong checkpoint interval %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_LOG_FILE:
+                log_filename = optarg;
+                break;
+            case OPT_READ_LIMIT:
+            case OPT_PUNCH_LIMIT:
+            case OPT_DISCARD_LIMIT:
+                if (limit_set(opt == OPT_READ_LIMIT ? "read-limit" :
+                              opt == OPT_PUNCH_LIMIT ? "punch-limit" : "discard-limit", optarg)) {
+                    printf("Wrong limit %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_CONTROL:
+                control_filename = optarg;
+                limits_enabled = 1;
+                break;
+            case OPT_IDLE:
+                io_idle = 1;
+                break;
+            case OPT_DIRECT:
+                direct_io = 1;
+                break;
+            case OPT_MANIFEST:
+                manifest_filename = optarg;
+                break;
+            case OPT_INCREMENTAL:
+                incremental = 1;
+                break;
+            case OPT_PLAN_SAVE:
+                plan_save_filename = optarg;
+                break;
+            case OPT_PLAN_APPLY:
+                plan_apply_filename = optarg;
+                break;
+            case OPT_DEADLINE:
+                if (parse_long(optarg, 1, LONG_MAX, 1, &deadline)) {
+                    printf("Wrong deadline %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_SAMPLE:
+                sample_percent = strtod(optarg, &end);
+                if ((*end != '\0') || !(sample_percent > 0) || (sample_percent > 100)) {
+                    printf("Sample must be between 0 and 100 percent\n");
+                    goodbye = 2;
+                }
+                break;
+            case OPT_SAMPLE_ERROR:
+                sample_error = strtod(optarg, &end);
+                if ((*end != '\0') || !(sample_error > 0) || (sample_error > 100)) {
+                    printf("Sample error must be between 0 and 100 percent\n");
+                    goodbye = 2;
+                }
+                break;
+            case OPT_METRICS:
+                metrics_filename = optarg;
+                break;
+            case OPT_METRICS_PROM:
+                metrics_prom_filename = optarg;
+                break;
+            case OPT_OBJECTS:
+                objects_enabled = 1;
+                break;
+            case OPT_MIN_HOLE:
+                if (parse_long(optarg, 1, LONG_MAX / 1024, 1024, &min_hole_size)) {
+                    printf("Wrong min hole size %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_ALIGN:
+                if (parse_long(optarg, 1, LONG_MAX / 1024, 1024, &punch_align)) {
+                    printf("Wrong alignment %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
+            case OPT_MAX_EXTENTS_PER_GIB:
+                if (parse_long(optarg, 1, LONG_MAX, 1, &max_extents_per_gib)) {
+                    printf("Wrong max extents per GiB %s\n", optarg);
+                    goodbye = 2;
+                }
+                break;
             default:
                 fprintf(stderr, "Unknown argument %s\n", optarg);
         }
@@ -203,389 +748,3269 @@ int mylog(int level, char *message) {
     return 0;
 }
 
-int stage1(void)
-{
-    struct page_header *page;
-    struct pip {
-        UCHAR bits[1];
-    };
-    struct pip *pip;
-    ULONG *pip_min;
-    //struct pip_page_ods11 *pip_page;
-    const USHORT page_size = header_page.hdr_page_size;
-    const USHORT ods_version = header_page.hdr_ods_version;
-    char message[128];
-
-    //read first pip page
-    short pip_num = 1;
-    ULONG pages_in_pip;
-    page = malloc(page_size);
-    switch (ods_version) {
-        case 0x800B: //Firebird 2.X
-        case 0xE002: //RedDatabase 2.X
-            pip = (struct pip *) page + offsetof(struct pip_page_ods11, bits);
-            pip_min = (ULONG *) page + offsetof(struct pip_page_ods11, min);
-            pages_in_pip = (page_size - offsetof(struct pip_page_ods11, bits)) * 8;
+void log_format(FILE *file, const struct log_record *record) {
+    switch (record->event) {
+        case LOG_TRIM_PAGES:
+            fprintf(file, "trim pages %ld - %ld (%ld pages)\n", record->value1, record->value2, record->value3);
             break;
-        case 0x800C: //Firebird 3.X
-        case 0xE00C: //RedDatabase 3.X
-        case 0x800D: //Firebird 4.X
-        case 0xE00D: //RedDatabase 4.X
-            pip = (struct pip *) page + offsetof(struct pip_page_ods12, bits);
-            pip_min = (ULONG *) page + offsetof(struct pip_page_ods12, min);
-            pages_in_pip = (page_size - offsetof(struct pip_page_ods12, bits)) * 8;
+        case LOG_TRIM_OFFSET:
+            fprintf(file, "\ttrim offset: %ld size: %ld\n", record->value1, record->value2);
             break;
-        default:
-            return ERR_UNSUPPORTED_ODS;
+        case LOG_PAGE_BITMAP:
+            fprintf(file, "Page %lu (%s), bitmap 0x%lx\n", record->value1,
+                    page_type_name[record->page_type], record->value2);
             break;
     }
-    if (log_level >= 2) {
-        sprintf(message, "Read 1 pip page %u\n", FIRST_PIP_PAGE);
-        mylog(2, message);
+}
+
+//Ring of the calling thread, allocated on first use. Without ring records are printed synchronously.
+struct log_ring *log_ring_get(int index) {
+    if (!log_writer_started)
+        return NULL;
+    struct log_ring *ring = log_rings[index];
+    if (ring == NULL) {
+        if (posix_memalign((void **) &ring, 64, sizeof(*ring)))
+            return NULL;
+        ring->head = 0;
+        ring->tail = 0;
+        __atomic_store_n(&log_rings[index], ring, __ATOMIC_RELEASE);
     }
-    if (pread(fd, page, page_size, FIRST_PIP_PAGE * page_size) != page_size) {
-        fprintf(stderr, "Error read page %u\n", FIRST_PIP_PAGE);
-        free(page);
-        return ERR_IO;
+    return ring;
+}
+
+//Add record of level 3 to ring, waits for log writer if ring is full
+void log_event(struct log_ring *ring, int event, int page_type, long value1, long value2, long value3) {
+    struct log_record *record;
+    struct log_record sync_record;
+
+    if (ring == NULL) {
+        record = &sync_record;
+    } else {
+        while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+            sched_yield();
+        record = &ring->records[ring->head & (LOG_RING_SIZE - 1)];
     }
+    record->event = event;
+    record->page_type = page_type;
+    record->value1 = value1;
+    record->value2 = value2;
+    record->value3 = value3;
+    if (ring == NULL)
+        log_format(stdout, record);
+    else
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
 
-    for (long i = *pip_min; i < total_pages; i++) {
-        //Read next pip?
-        if (i + 1 == pip_num * pages_in_pip) {
-            if (log_level >= 2) {
-                sprintf(message, "Read %d pip page %lu\n", pip_num + 1, i);
-                mylog(2, message);
-            }
-            if (pread(fd, page, page_size, i * page_size) != page_size) {
-                fprintf(stderr, "Error read page %lu\n", i);
-                free(page);
-                return ERR_IO;
-            }
-            if (page->page_type != PT_PAGE_INVENTORY) {
-                fprintf(stderr, "Page %lu is not pip!\n", i);
-                free(page);
-                return ERR_IO;
-            }
-            pip_num++;
-        } else {
-            //Stage 1: check page in PIP
-            if ((pip->bits[i % pages_in_pip / 8]) & (0x01 << i % 8)) {
-                pages_for_trim++;
-                //trim
-                if (log_level >= 3) {
-                    sprintf(message, "trim page %lu\n", i + 1);
-                    mylog(3, message);
-                }
-                if (trim) {
-                    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, i * page_size, page_size)) {
-                        fprintf(stderr, "fallocate failed\n");
-                        free(page);
-                        return ERR_TRIM;
-                    }
-                }
+//Log writer thread: formats records of all rings until log_stop and rings are empty
+void * log_writer(void *argv) {
+    const struct timespec sleep_time = {0, LOG_WRITER_SLEEP_US * 1000L};
+    (void) argv;
+
+    while (1) {
+        const short stop = __atomic_load_n(&log_stop, __ATOMIC_ACQUIRE);
+        long written = 0;
+        for (int index = 0; index <= MAX_THREADS; index++) {
+            struct log_ring *ring = __atomic_load_n(&log_rings[index], __ATOMIC_ACQUIRE);
+            if (ring == NULL)
+                continue;
+            const long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            written += head - ring->tail;
+            for (long tail = ring->tail; tail < head; tail++) {
+                log_format(log_file, &ring->records[tail & (LOG_RING_SIZE - 1)]);
+                __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
             }
         }
-        //Print status bar
-        if (progress_bar_step > 0 && (((i * page_size) % progress_bar_step == 0) || (i + 1 == total_pages))) {
-            char db_size[32];
-            byte2str(db_size, total_pages * page_size);
-            char processed_size[32];
-            byte2str(processed_size, (i + 1) * page_size);
-            fprintf(stdout, "\rProcessed bytes %s / %s (%ld%%)",
-                    processed_size, db_size, 100 * (i + 1) / total_pages);
-            fflush(stdout);
+        if (written == 0) {
+            if (stop)
+                break;
+            fflush(log_file);
+            nanosleep(&sleep_time, NULL);
         }
     }
-    if (progress_bar_step > 0){
-        fprintf(stdout, "\n");
-        fflush(stdout);
+    fflush(log_file);
+    return 0;
+}
+
+int log_writer_start(void) {
+    log_file = stdout;
+    if (log_filename && (log_file = fopen(log_filename, "w")) == NULL) {
+        fprintf(stderr, "Error open log file %s\n", log_filename);
+        return ERR_IO;
     }
-    free(page);
+    if (pthread_create(&log_thread_id, NULL, log_writer, NULL) != 0) {
+        fprintf(stderr, "Error create log writer thread\n");
+        return ERR_MEM;
+    }
+    log_writer_started = 1;
     return 0;
 }
 
-void * stage2(void *argv) {
-    struct status *arg = argv;
-    int mutex_status = 0;
-    char *page;
-    unsigned long page_bitmap;  //MAX_PAGE_SIZE / min(block_size) = 32768 / 512 = 64 bit
-    struct page_header *page_header;
-    struct data_page *data_page;
-    struct blob_page *blob_page;
-    struct btree_page *btree_page;
-    unsigned long page_bitmap_fill = -1;
-    unsigned long data_page_bitmap_fill;
-    unsigned long blob_page_bitmap_fill;
-    unsigned long btree_page_bitmap_fill;
-    const USHORT page_size = header_page.hdr_page_size;
-    const USHORT ods_version = header_page.hdr_ods_version;
-    char message[128];
-    long blocks_for_trim_thr = arg->blocks_for_trim;
+//Wait until log writer formats all records written before
+void log_flush(void) {
+    const struct timespec sleep_time = {0, LOG_WRITER_SLEEP_US * 1000L};
 
-    if (log_level >= 2) {
-        sprintf(message, "Started thread %d\n", arg->thread_number);
-        mylog(2, message);
+    if (!log_writer_started)
+        return;
+    for (int index = 0; index <= MAX_THREADS; index++) {
+        struct log_ring *ring = __atomic_load_n(&log_rings[index], __ATOMIC_ACQUIRE);
+        if (ring == NULL)
+            continue;
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+            nanosleep(&sleep_time, NULL);
     }
+}
 
-    page_bitmap_fill = page_bitmap_fill >> (8 * sizeof(page_bitmap_fill) - page_size / block_size);
-    data_page_bitmap_fill = 0;
-    for (int bit = 0; bit <= (offsetof(struct data_page, dpg_rpt)) / block_size; bit++) {
-        data_page_bitmap_fill |= 1UL << bit;
+void log_writer_stop(void) {
+    if (!log_writer_started)
+        return;
+    __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(log_thread_id, NULL);
+    log_writer_started = 0;
+    for (int index = 0; index <= MAX_THREADS; index++) {
+        free(log_rings[index]);
+        log_rings[index] = NULL;
     }
-    blob_page_bitmap_fill = 0;
-    for (int bit = 0; bit <= (offsetof(struct blob_page, blp_page)) / block_size; bit++) {
-        blob_page_bitmap_fill |= 1UL << bit;
+    if (log_file != stdout)
+        fclose(log_file);
+}
+
+void control_signal(int signum) {
+    (void) signum;
+    control_reload = 1;
+}
+
+//Read limits from control file, called under mutex_limits
+void control_file_read(void) {
+    char line[256];
+    char name[64];
+    char value[64];
+    FILE *control_file = fopen(control_filename, "r");
+
+    if (control_file == NULL) {
+        fprintf(stderr, "Error open control file %s\n", control_filename);
+        return;
     }
-    btree_page_bitmap_fill = 0;
-    for (int bit = 0; bit <= (sizeof(struct btree_page)) / block_size; bit++) {
-        btree_page_bitmap_fill |= 1UL << bit;
+    while (fgets(line, sizeof(line), control_file)) {
+        if (sscanf(line, "%63s %63s", name, value) != 2 || name[0] == '#')
+            continue;
+        if (limit_set(name, value))
+            fprintf(stderr, "Wrong line in control file: %s", line);
     }
+    fclose(control_file);
+    if (log_level >= 1)
+        fprintf(stdout, "Limits: read %.1f MiB/s, punch %.1f calls/s, discard %.1f MiB/s\n",
+                read_limit.rate / 1048576, punch_limit.rate, discard_limit.rate / 1048576);
+}
 
-    page = malloc(page_size);
-    //todo: replace i with a meaningful name page_num, page_index, etc
-    for (long i = arg->position; i < arg->finish; i++) {
-        //Stage 2: Analyze page filling
-        if (pread(fd, page, page_size, i * page_size) == page_size) {
-            page_header = (struct page_header *) page;
-            page_bitmap = 0;
-            switch (page_header->page_type) {
-                case PT_UNDEFINED_PAGE:
-                    page_bitmap = 0UL;
-                    break;
-                case PT_DATA:
-                    data_page = (struct data_page *) page;
-                    page_bitmap = data_page_bitmap_fill;
-                    for (int bit = (int) (offsetof(struct data_page, dpg_rpt)) / block_size;
-                         bit <= (offsetof(struct data_page, dpg_rpt) +
-                                 sizeof(struct dpg_repeat) * data_page->count) / block_size;
-                         bit++)
-                    {
-                        page_bitmap |= 1UL << bit;
-                    }
-                    for (unsigned short cnt = 0; cnt < data_page->count; cnt++) {
-                        const int low_bit = data_page->dpg_rpt[cnt].dpg_offset / block_size;
-                        const int high_bit = (data_page->dpg_rpt[cnt].dpg_offset +
-                                              data_page->dpg_rpt[cnt].dpg_length - 1) / block_size;
-                        for (int bit = low_bit; bit <= high_bit; bit++) {
-                            page_bitmap |= 1UL << bit;
-                        }
-                    }
-                    break;
-                case PT_B_TREE:
-                    btree_page = (struct btree_page *) page;
-                    if (btree_page->btr_length >= page_size - block_size)
-                    {
-                        page_bitmap = page_bitmap_fill;
-                    } else {
-                        page_bitmap = btree_page_bitmap_fill;
-                        const int low_bit = (int) (sizeof(struct btree_page)) / block_size;
-                        const int high_bit = (int) (btree_page->btr_length) / block_size;
-                        for (int bit = low_bit; bit <= high_bit; bit++) {
-                            page_bitmap |= 1UL << bit;
-                        }
-                    }
-                    break;
-                case PT_BLOB:
-                    blob_page = (struct blob_page *) page;
-                    if (offsetof(struct blob_page, blp_page) + blob_page->blp_length >= page_size - block_size) {
-                        page_bitmap = page_bitmap_fill;
-                    } else {
-                        page_bitmap = blob_page_bitmap_fill;
-                        const int low_bit = (int) (offsetof(struct blob_page, blp_page)) / block_size;
-                        const int high_bit =
-                                (int) (offsetof(struct blob_page, blp_page) + blob_page->blp_length) / block_size;
-                        for (int bit = low_bit; bit <= high_bit; bit++) {
-                            page_bitmap |= 1UL << bit;
-                        }
-                    }
-                    break;
-            }
-
-            //Trim blocks
-            if ((page_bitmap < page_bitmap_fill) && (page_bitmap != 0)) {
-                if (log_level >= 3) {
-                    sprintf(message, "Page %lu (%s), bitmap 0x%lx\n", i,
-                            page_type_name[page_header->page_type], page_bitmap);
-                    mylog(3, message);
-                }
-                //blocks for trim
-                int blocks_for_trim_on_page = 0;
-                const int bits_per_page = page_size / block_size;
-                for (int bit = 0; bit < bits_per_page; bit++) {
-                    // todo: Add compare with 255UL, 127UL, 63UL, 31UL, 15UL
-                    // 8 bits - 32K page, 4K block I/O
-                    // 4 bits - 16K page, 4K block I/O
-                    if ((bits_per_page - bit >= 3) && !(page_bitmap & (7UL << bit))) {
-                        blocks_for_trim_thr += 3;
-                        blocks_for_trim_on_page = 3;
-                    } else {
-                        if ((bits_per_page - bit >= 2) && !(page_bitmap & (3UL << bit))) {
-                            blocks_for_trim_thr += 2;
-                            blocks_for_trim_on_page = 2;
-                        } else {
-                            if ((bits_per_page - bit >= 1) && !(page_bitmap & (1UL << bit))) {
-                                blocks_for_trim_thr += 1;
-                                blocks_for_trim_on_page = 1;
-                            }
-                        }
-                    }
-                    if (trim & blocks_for_trim_on_page) {
-                        if (log_level >= 3) {
-                            sprintf(message, "\ttrim %d blocks on page %ld, bit %d\n",
-                                    blocks_for_trim_on_page, i, bit);
-                            mylog(3, message);
-                            sprintf(message, "\toffset: %ld size: %d\n",
-                                    i * page_size + bit * block_size, block_size * blocks_for_trim_on_page);
-                            mylog(3, message);
-                        }
-                        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-                                      i * page_size + bit * block_size, block_size * blocks_for_trim_on_page)) {
-                            fprintf(stderr, "fallocate failed\n");
-                            free(page);
-                            arg->blocks_for_trim = blocks_for_trim_thr;
-                            arg->error = ERR_TRIM;
-                            return 0;
-                        }
-                    }
-                    if (blocks_for_trim_on_page) {
-                        bit += blocks_for_trim_on_page - 1;
-                        blocks_for_trim_on_page = 0;
-                    }
-                }
-            }
-        } else {
-            free(page);
-            arg->blocks_for_trim = blocks_for_trim_thr;
-            arg->error = ERR_IO;
-            return 0;
-        }
-        //Write status in status file
-        if (fd_status_file)
-        {
-            arg->position = i;
-            arg->blocks_for_trim = blocks_for_trim_thr;
-            long bytes_written = pwrite(fd_status_file, arg, sizeof(*arg),
-                                        sizeof(ver_status_file) + sizeof(threads_count) + sizeof(*arg) * arg->thread_number);
-            if (bytes_written != sizeof(*arg))
-            {
-                fprintf(stderr, "Error write data in status file. Writen %ld, must %ld\n", bytes_written, sizeof(*arg));
-                return 0;
-            }
-        }
-        //Print status bar
-        if ((progress_bar_step > 0) &&  ((((i - arg->start ) * page_size)  % progress_bar_step == 0) || (i + 1 == arg->finish))) {
-            char buf[MAX_THREADS + 1];
-            buf[0] = '\r';
-            for(int t = 0; t < arg->thread_number; t++) {
-                buf[t + 1] = '\t';
-            }
-            // proc
-            mutex_status = pthread_mutex_lock(&mutex_stdout);
-            if (mutex_status != 0) {
-                fprintf(stderr, "Error %d lock mutex in thread %d\n", mutex_status, arg->thread_number);
-                arg->error = ERR_MUTEX;
-                return 0;
-            }
-            fprintf(stdout, "%s%ld%%", buf, 100 * (i + 1 - arg->start) / (arg->finish - arg->start));
-            fflush(stdout);
-            mutex_status = pthread_mutex_unlock(&mutex_stdout);
-            if (mutex_status != 0) {
-                fprintf(stderr, "Error %d unlock mutex in thread %d\n", mutex_status, arg->thread_number);
-                arg->error = ERR_MUTEX;
-                return 0;
-            }
+//Read control file on SIGHUP or when it is modified, checked once per second. Called under mutex_limits.
+void control_file_check(const struct timespec *now) {
+    struct stat control_stat;
 
-        }
+    if (control_filename == NULL)
+        return;
+    if (!control_reload && now->tv_sec - control_checked < 1)
+        return;
+    control_checked = now->tv_sec;
+    if (stat(control_filename, &control_stat) != 0)
+        return;
+    if (control_reload || control_stat.st_mtime != control_mtime) {
+        control_reload = 0;
+        control_mtime = control_stat.st_mtime;
+        control_file_read();
     }
-    free(page);
-    arg->blocks_for_trim = blocks_for_trim_thr;
-    arg->error = 0;
-    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    struct stat fstat_before, fstat_after;
-    int status;
-    int load_from_status_file = 0;
-    char message[128];
-    int err = 0;
-    char buf4size[32];
+//Take amount of tokens from bucket, sleeps when the debt of bucket is not paid yet.
+//The debt is kept in bucket, so all threads together don't exceed the limit.
+void limit_wait(struct token_bucket *bucket, long amount) {
+    struct timespec now;
+    double wait = 0;
 
-    parse(argc, argv);
-    if (goodbye > 0)
-        return goodbye - 1;
-    //todo: Change info from different debug levels
-    //todo: Change format, max page count
-    if (status_filename && (db_filename == NULL)) {
-        fd_status_file = open(status_filename, O_RDONLY);
-        if (fd_status_file < 0) {
-            fprintf(stderr, "Error %d open file %s\n", fd_status_file, status_filename);
-            return ERR_IO;
-        }
-        if (read(fd_status_file, &ver_status_file, sizeof(ver_status_file)) != sizeof(ver_status_file))
-        {
-            fprintf(stderr, "Error read status file");
-            return ERR_IO;
-        }
-        if (ver_status_file != VER_STATUS_FILE)
-        {
-            fprintf(stderr, "Incompatible version status file %d\n", ver_status_file);
-            return ERR_INCMP;
-        }
-        if (read(fd_status_file, &threads_count, sizeof(threads_count)) != sizeof(threads_count))
-        {
-            fprintf(stderr, "Error read status file");
-           return ERR_IO;
-        }
-        fprintf(stdout, "Version %d, threads %d\n", ver_status_file, threads_count);
-        fprintf(stdout, "thread\terror\tstart\tfinish\tpos\ttrim\n"
-                        "\t\tpage\tpage\t\tblock\n");
-        struct status thr_status;
-        while (read(fd_status_file, &thr_status, sizeof(thr_status)) == sizeof(thr_status)) {
-            fprintf(stdout, "%d\t%d\t%ld\t%ld\t%ld\t%ld\n", thr_status.thread_number, thr_status.error,
-                    thr_status.start, thr_status.finish, thr_status.position, thr_status.blocks_for_trim);
-        }
-        close(fd_status_file);
-        return 0;
+    if (!limits_enabled)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&mutex_limits);
+    control_file_check(&now);
+    if (bucket->rate > 0) {
+        bucket->tokens += ((double) (now.tv_sec - bucket->updated.tv_sec) +
+                           (double) (now.tv_nsec - bucket->updated.tv_nsec) / 1e9) * bucket->rate;
+        if (bucket->tokens > bucket->rate)
+            bucket->tokens = bucket->rate;
+        bucket->tokens -= (double) amount;
+        if (bucket->tokens < 0)
+            wait = -bucket->tokens / bucket->rate;
     }
-    if (!db_filename) {
-        help(argv[0]);
-        return 0;
+    bucket->updated = now;
+    pthread_mutex_unlock(&mutex_limits);
+    if (wait > 0) {
+        const struct timespec sleep_time = {(time_t) wait, (long) ((wait - (double) (time_t) wait) * 1e9)};
+        nanosleep(&sleep_time, NULL);
     }
+}
 
-    if (!trim) {
-        mylog(1, "Dry run mode\n");
-    }
+//Limits of one fallocate call
+void limit_punch(long length) {
+    limit_wait(&punch_limit, 1);
+    limit_wait(&discard_limit, length);
+}
 
-    if (trim) {
-        fd = open(db_filename, O_RDWR);
-    } else {
-        fd = open(db_filename, O_RDONLY);
-    }
-    if (fd < 0) {
-        fprintf(stderr, "Error %d open file %s\n", fd, db_filename);
+//Idle I/O priority of the calling thread
+int set_io_idle(void) {
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT_) != 0) {
+        fprintf(stderr, "Error %d set idle I/O priority\n", errno);
         return ERR_IO;
     }
+    return 0;
+}
 
-    //read page_size & ods_version
-    if (pread(fd, &header_page, sizeof(header_page), 0) != sizeof(header_page))
-    {
-        fprintf(stderr, "Error reading header page\n");
-        return ERR_IO;
+//Append run of free pages to the list of stage 1
+int add_page_run(struct page_run **runs, long *runs_count, long *runs_allocated, long start, long length) {
+    if (*runs_count == *runs_allocated) {
+        long allocated = *runs_allocated ? *runs_allocated * 2 : 1024;
+        struct page_run *reallocated = realloc(*runs, allocated * sizeof(struct page_run));
+        if (reallocated == NULL) {
+            fprintf(stderr, "Error allocating memory for runs of pages\n");
+            return ERR_MEM;
+        }
+        *runs = reallocated;
+        *runs_allocated = allocated;
     }
-    sprintf(message, "Page size %d\n", header_page.hdr_page_size);
-    mylog(1, message);
-    sprintf(message, "ODS version %x (%s)\n", header_page.hdr_ods_version, ods2str());
-    mylog(1, message);
+    (*runs)[*runs_count].start = start;
+    (*runs)[*runs_count].length = length;
+    (*runs_count)++;
+    return 0;
+}
 
-    //CHECKS
+int add_free_run(long start, long length) {
+    return add_page_run(&free_runs, &free_runs_count, &free_runs_allocated, start, length);
+}
 
-    //Check argument compatibility
-    //Args -d и -P incompatible
-    if (progress_bar_step > 0 && log_level > 1) {
-        fprintf(stderr, "Progress bar and debug level greater than 1 are incompatible.\n");
-        return 1;
-    }
+//Add hole of file [offset, data) to map, only whole pages of it
+int add_hole(long offset, long data) {
+    const USHORT page_size = header_page.hdr_page_size;
+    const long start = (offset + page_size - 1) / page_size;
+    const long finish = data / page_size;
+
+    if (finish <= start)
+        return 0;
+    hole_pages += finish - start;
+    if (holes_count && holes[holes_count - 1].start + holes[holes_count - 1].length == start) {
+        holes[holes_count - 1].length += finish - start;
+        return 0;
+    }
+    return add_page_run(&holes, &holes_count, &holes_allocated, start, finish - start);
+}
+
+//Map of holes from FIEMAP, FIEMAP_BATCH extents per call. Returns -1 if FIEMAP is not supported.
+#define FIEMAP_BATCH 512
+int build_hole_map_fiemap(long file_size) {
+    struct fiemap *map = malloc(sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+    long data_finish = 0;
+    int last = 0;
+    int err = 0;
+
+    if (map == NULL) {
+        fprintf(stderr, "Error allocating memory for FIEMAP\n");
+        return ERR_MEM;
+    }
+    while (!last && data_finish < file_size) {
+        memset(map, 0, sizeof(struct fiemap));
+        map->fm_start = data_finish;
+        map->fm_length = file_size - data_finish;
+        map->fm_extent_count = FIEMAP_BATCH;
+        if (ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+            err = -1;
+            break;
+        }
+        if (map->fm_mapped_extents == 0)
+            break;
+        for (unsigned i = 0; i < map->fm_mapped_extents; i++) {
+            const struct fiemap_extent *extent = &map->fm_extents[i];
+            if ((long) extent->fe_logical > data_finish && (err = add_hole(data_finish, (long) extent->fe_logical)))
+                break;
+            if ((long) (extent->fe_logical + extent->fe_length) > data_finish)
+                data_finish = (long) (extent->fe_logical + extent->fe_length);
+            if (extent->fe_flags & FIEMAP_EXTENT_LAST)
+                last = 1;
+        }
+        if (err)
+            break;
+    }
+    free(map);
+    if (err == 0 && data_finish < file_size)
+        err = add_hole(data_finish, file_size);
+    return err;
+}
+
+//Map of holes from SEEK_DATA / SEEK_HOLE, two calls per hole
+int build_hole_map_seek(long file_size) {
+    long offset = 0;
+
+    while (offset < file_size) {
+        long data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO)
+                return 0;
+            data = file_size;
+        }
+        if (data > file_size)
+            data = file_size;
+        if (add_hole(offset, data))
+            return ERR_MEM;
+        if (data >= file_size)
+            break;
+        offset = lseek(fd, data, SEEK_HOLE);
+        if (offset < 0)
+            return 0;
+    }
+    return 0;
+}
+
+//Build map of holes with FIEMAP or SEEK_DATA / SEEK_HOLE. Without support of filesystem the whole file is data.
+int build_hole_map(void) {
+    const long file_size = total_pages * header_page.hdr_page_size;
+    const int status = build_hole_map_fiemap(file_size);
+
+    if (status >= 0)
+        return status;
+    holes_count = 0;
+    hole_pages = 0;
+    mylog(2, "FIEMAP is not supported, use SEEK_HOLE\n");
+    return build_hole_map_seek(file_size);
+}
+
+//Find runs of free pages in the PIP bitmap, 64 pages per step.
+//Bit is set for free page. run_start is -1 when no run is open, an open run continues into the next call.
+int scan_pip_bits(const UCHAR *bits, long first_page, long bits_count, long *run_start) {
+    for (long pos = 0; pos < bits_count; pos += 64) {
+        unsigned long word = 0;
+        const long word_bits = bits_count - pos < 64 ? bits_count - pos : 64;
+        memcpy(&word, bits + pos / 8, (word_bits + 7) / 8);
+        word = le64toh(word);
+        if (word_bits < 64)
+            word &= (1UL << word_bits) - 1;
+
+        //All pages in word are used or free
+        if (word == 0 && *run_start < 0)
+            continue;
+        if (word == ~0UL && *run_start >= 0)
+            continue;
+
+        int bit = 0;
+        while (bit < 64) {
+            if (*run_start < 0) {
+                const unsigned long free_bits = word >> bit;
+                if (free_bits == 0)
+                    break;
+                bit += __builtin_ctzl(free_bits);
+                *run_start = first_page + pos + bit;
+            } else {
+                const unsigned long used_bits = ~word >> bit;
+                if (used_bits == 0)
+                    break;
+                bit += __builtin_ctzl(used_bits);
+                if (add_free_run(*run_start, first_page + pos + bit - *run_start))
+                    return ERR_MEM;
+                *run_start = -1;
+            }
+        }
+    }
+    return 0;
+}
+
+//Index of the first free run that ends after page, free_runs_count if there is no such run
+long find_page_run(const struct page_run *runs, long runs_count, long page) {
+    long low = 0;
+    long high = runs_count;
+    while (low < high) {
+        const long middle = low + (high - low) / 2;
+        if (runs[middle].start + runs[middle].length <= page)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+long find_free_run(long page) {
+    return find_page_run(free_runs, free_runs_count, page);
+}
+
+long find_hole(long page) {
+    return find_page_run(holes, holes_count, page);
+}
+
+long monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void latency_add(struct latency_histogram *histogram, const struct timespec *start) {
+    const double seconds = seconds_since(start);
+    const unsigned long microseconds = (unsigned long) (seconds * 1e6);
+    int bucket = microseconds <= 1 ? 0 : 64 - __builtin_clzl(microseconds - 1);
+
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    histogram->count[bucket]++;
+    histogram->calls++;
+    histogram->seconds += seconds;
+}
+
+void latency_merge(struct latency_histogram *histogram, const struct latency_histogram *other) {
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        histogram->count[bucket] += other->count[bucket];
+    }
+    histogram->calls += other->calls;
+    histogram->seconds += other->seconds;
+}
+
+int deadline_passed(void) {
+    if (deadline == 0)
+        return 0;
+    if (monotonic_seconds() >= deadline_time)
+        __atomic_store_n(&deadline_reached, 1, __ATOMIC_RELAXED);
+    return __atomic_load_n(&deadline_reached, __ATOMIC_RELAXED);
+}
+
+//Punch policy: range is cut to punch_align, then it is kept when it is shorter than min_hole_size
+//or its GiB of file has max_extents_per_gib trimmed ranges already. Returns 0 for kept range.
+int punch_policy(struct stage2_stats *stats, long *offset, long *length) {
+    const long finish = *offset + *length;
+    long start = *offset;
+    long end = finish;
+
+    if (punch_align) {
+        start = (start + punch_align - 1) / punch_align * punch_align;
+        end = end / punch_align * punch_align;
+    }
+    //Limit per GiB is taken by trim run only, first come, first served by threads
+    if (end - start < (min_hole_size > 1 ? min_hole_size : 1) ||
+        (max_extents_per_gib && trim &&
+         __atomic_add_fetch(&gib_extents[start >> 30], 1, __ATOMIC_RELAXED) > max_extents_per_gib)) {
+        stats->policy_extents++;
+        stats->policy_bytes += *length;
+        return 0;
+    }
+    stats->policy_bytes += *length - (end - start);
+    *offset = start;
+    *length = end - start;
+    return 1;
+}
+
+//FIEMAP extents of file, -1 if FIEMAP is not supported
+long file_extents(void) {
+    struct fiemap map;
+
+    memset(&map, 0, sizeof(map));
+    map.fm_length = FIEMAP_MAX_OFFSET;
+    if (ioctl(fd, FS_IOC_FIEMAP, &map) != 0)
+        return -1;
+    return map.fm_mapped_extents;
+}
+
+//Trim run of free pages on stage 1, one fallocate call per extent
+int stage1_trim_run(long start, long length) {
+    const USHORT page_size = header_page.hdr_page_size;
+    long max_run_length = max_extent_size / page_size;
+    struct log_ring *log = log_level >= 3 ? log_ring_get(0) : NULL;
+
+    if (max_run_length == 0)
+        max_run_length = max_extent_size ? 1 : length;
+    stage1_pages_trimmed += length;
+    for (long extent = start; extent < start + length; extent += max_run_length) {
+        const long extent_length = start + length - extent < max_run_length ? start + length - extent : max_run_length;
+        long offset = extent * page_size;
+        long bytes = extent_length * page_size;
+        //Free runs of deferred trim get the policy in stage 2 threads
+        if (!stage1_trim_deferred && !punch_policy(&main_stats, &offset, &bytes))
+            continue;
+        extents_for_trim++;
+        //Deferred runs are logged by stage 2 threads that trim them, range cut by punch policy is logged by offset
+        if (log_level >= 3 && !stage1_trim_deferred) {
+            if (offset % page_size == 0 && bytes % page_size == 0)
+                log_event(log, LOG_TRIM_PAGES, 0, offset / page_size, (offset + bytes) / page_size - 1, bytes / page_size);
+            else
+                log_event(log, LOG_TRIM_OFFSET, 0, offset, bytes, 0);
+        }
+        if (trim && !stage1_trim_deferred) {
+            struct timespec started;
+            limit_punch(bytes);
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, bytes)) {
+                fprintf(stderr, "fallocate failed\n");
+                return ERR_TRIM;
+            }
+            latency_add(&main_stats.fallocate_latency, &started);
+            main_stats.trimmed_bytes += bytes;
+        }
+    }
+    return 0;
+}
+
+//Free run is trimmed at once, in deadline mode it is saved to be trimmed by stage1_trim_longest()
+int stage1_trim_add(long start, long length) {
+    if (deadline)
+        return add_page_run(&trim_runs, &trim_runs_count, &trim_runs_allocated, start, length);
+    return stage1_trim_run(start, length);
+}
+
+int page_run_compare_longer(const void *a, const void *b) {
+    const struct page_run *run_a = a;
+    const struct page_run *run_b = b;
+    if (run_a->length != run_b->length)
+        return run_a->length > run_b->length ? -1 : 1;
+    return run_a->start < run_b->start ? -1 : run_a->start > run_b->start;
+}
+
+//Deadline mode: trim the longest free runs first, until the deadline
+int stage1_trim_longest(void) {
+    int status = 0;
+
+    qsort(trim_runs, trim_runs_count, sizeof(struct page_run), page_run_compare_longer);
+    for (long run = 0; run < trim_runs_count && !deadline_passed(); run++) {
+        if ((status = stage1_trim_run(trim_runs[run].start, trim_runs[run].length)) != 0)
+            break;
+    }
+    free(trim_runs);
+    trim_runs = NULL;
+    return status;
+}
+
+int stage1(void)
+{
+    struct page_header *page;
+    UCHAR *pip_bits;
+    const USHORT page_size = header_page.hdr_page_size;
+    const USHORT ods_version = header_page.hdr_ods_version;
+    char message[128];
+    int status;
+
+    //read first pip page
+    long pip_num = 1;
+    long pip_page = FIRST_PIP_PAGE;
+    ULONG pages_in_pip;
+    page = malloc(page_size);
+    switch (ods_version) {
+        case 0x800B: //Firebird 2.X
+        case 0xE002: //RedDatabase 2.X
+            pip_bits = (UCHAR *) page + offsetof(struct pip_page_ods11, bits);
+            pages_in_pip = (page_size - offsetof(struct pip_page_ods11, bits)) * 8;
+            break;
+        case 0x800C: //Firebird 3.X
+        case 0xE00C: //RedDatabase 3.X
+        case 0x800D: //Firebird 4.X
+        case 0xE00D: //RedDatabase 4.X
+            pip_bits = (UCHAR *) page + offsetof(struct pip_page_ods12, bits);
+            pages_in_pip = (page_size - offsetof(struct pip_page_ods12, bits)) * 8;
+            break;
+        default:
+            free(page);
+            return ERR_UNSUPPORTED_ODS;
+    }
+
+    //Pip number N (from 1) describes pages [(N - 1) * pages_in_pip, N * pages_in_pip),
+    //next pip is the last page of this range
+    long run_start = -1;
+    for (long first_page = 0; first_page < total_pages; first_page += pages_in_pip) {
+        if (log_level >= 2) {
+            sprintf(message, "Read %ld pip page %ld\n", pip_num, pip_page);
+            mylog(2, message);
+        }
+        if (pread(fd, page, page_size, pip_page * page_size) != page_size) {
+            fprintf(stderr, "Error read page %lu\n", pip_page);
+            free(page);
+            return ERR_IO;
+        }
+        if (page->page_type != PT_PAGE_INVENTORY) {
+            fprintf(stderr, "Page %lu is not pip!\n", pip_page);
+            free(page);
+            return ERR_IO;
+        }
+        //Header page and first pip are never free
+        if (first_page == 0)
+            pip_bits[0] &= ~0x03;
+        //The last page of the range is the next pip, it is never free
+        long bits_count = total_pages - first_page < pages_in_pip - 1 ? total_pages - first_page : pages_in_pip - 1;
+        status = scan_pip_bits(pip_bits, first_page, bits_count, &run_start);
+        if (status) {
+            free(page);
+            return status;
+        }
+        if (bits_count == pages_in_pip - 1 && run_start >= 0) {
+            status = add_free_run(run_start, first_page + bits_count - run_start);
+            if (status) {
+                free(page);
+                return status;
+            }
+            run_start = -1;
+        }
+        pip_num++;
+        pip_page = first_page + pages_in_pip - 1;
+
+        //Print status bar
+        if (progress_bar_step > 0) {
+            const long processed = first_page + pages_in_pip < total_pages ? first_page + pages_in_pip : total_pages;
+            char db_size[32];
+            byte2str(db_size, total_pages * page_size);
+            char processed_size[32];
+            byte2str(processed_size, processed * page_size);
+            fprintf(stdout, "\rProcessed bytes %s / %s (%ld%%)",
+                    processed_size, db_size, 100 * processed / total_pages);
+            fflush(stdout);
+        }
+    }
+    if (run_start >= 0) {
+        status = add_free_run(run_start, total_pages - run_start);
+        if (status) {
+            free(page);
+            return status;
+        }
+    }
+    if (progress_bar_step > 0){
+        fprintf(stdout, "\n");
+        fflush(stdout);
+    }
+    free(page);
+
+    //The same list of runs is used for dry run and trim, pages in holes are trimmed already
+    long hole = 0;
+    for (long run = 0; run < free_runs_count; run++) {
+        long start = free_runs[run].start;
+        const long finish = start + free_runs[run].length;
+        pages_for_trim += free_runs[run].length;
+        while (hole < holes_count && holes[hole].start + holes[hole].length <= start)
+            hole++;
+        for (; hole < holes_count && holes[hole].start < finish; hole++) {
+            const long hole_start = holes[hole].start > start ? holes[hole].start : start;
+            const long hole_finish = holes[hole].start + holes[hole].length < finish ?
+                                     holes[hole].start + holes[hole].length : finish;
+            if (hole_start > start && (status = stage1_trim_add(start, hole_start - start)) != 0)
+                return status;
+            free_pages_in_holes += hole_finish - hole_start;
+            start = hole_finish;
+            if (hole_finish == finish)
+                break;
+        }
+        if (finish > start && (status = stage1_trim_add(start, finish - start)) != 0)
+            return status;
+    }
+    if (deadline)
+        return stage1_trim_longest();
+    return 0;
+}
+
+//Read count bytes, pread may return less than requested
+int read_full(char *buffer, long count, long offset) {
+    while (count > 0) {
+        const long bytes_read = pread(fd_read, buffer, count, offset);
+        if (bytes_read <= 0)
+            return ERR_IO;
+        buffer += bytes_read;
+        offset += bytes_read;
+        count -= bytes_read;
+    }
+    return 0;
+}
+
+//Logical block size of device with database file, O_DIRECT reads are aligned to it
+long logical_block_size(void) {
+    struct stat db_stat;
+    char path[128];
+    long size = 0;
+
+    if (fstat(fd, &db_stat) != 0)
+        return DEFAULT_LOGICAL_BLOCK_SIZE;
+    //Device of partition has no queue, it is in the parent directory
+    const char *formats[] = {"/sys/dev/block/%u:%u/queue/logical_block_size",
+                             "/sys/dev/block/%u:%u/../queue/logical_block_size"};
+    for (int i = 0; i < 2 && size <= 0; i++) {
+        snprintf(path, sizeof(path), formats[i], major(db_stat.st_dev), minor(db_stat.st_dev));
+        FILE *file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+        if (fscanf(file, "%ld", &size) != 1)
+            size = 0;
+        fclose(file);
+    }
+    return size > 0 ? size : DEFAULT_LOGICAL_BLOCK_SIZE;
+}
+
+//Open database for stage 2 reads with O_DIRECT. If O_DIRECT can't be used, reads are buffered
+//and every read chunk is dropped from page cache.
+void direct_io_open(void) {
+    const USHORT page_size = header_page.hdr_page_size;
+    const long block = logical_block_size();
+    char message[128];
+    char *page;
+
+    if (page_size % block || (probe_pages && block_size % block) || READ_CHUNK_ALIGN % block) {
+        sprintf(message, "Logical block size %ld doesn't allow O_DIRECT, drop read pages from cache\n", block);
+        mylog(1, message);
+    } else if ((fd_read = open(db_filename, O_RDONLY | O_DIRECT)) < 0) {
+        mylog(1, "O_DIRECT is not supported, drop read pages from cache\n");
+    } else if (posix_memalign((void **) &page, READ_CHUNK_ALIGN, page_size) == 0) {
+        //Some filesystems fail O_DIRECT only on read
+        const long bytes_read = pread(fd_read, page, page_size, 0);
+        free(page);
+        if (bytes_read == page_size) {
+            sprintf(message, "Read with O_DIRECT, logical block size %ld\n", block);
+            mylog(2, message);
+            return;
+        }
+        close(fd_read);
+        mylog(1, "O_DIRECT read failed, drop read pages from cache\n");
+    } else {
+        close(fd_read);
+    }
+    fd_read = fd;
+    direct_io = 0;
+    drop_cache = 1;
+}
+
+//Read chunk of pages is processed, drop it from page cache in buffered mode
+void drop_chunk(long chunk_start, long chunk_finish) {
+    const USHORT page_size = header_page.hdr_page_size;
+
+    if (drop_cache)
+        posix_fadvise(fd_read, chunk_start * page_size, (chunk_finish - chunk_start) * page_size,
+                      POSIX_FADV_DONTNEED);
+}
+
+//Read count bytes of file from the start
+int read_file(int fd_file, char *buffer, long count) {
+    long offset = 0;
+    while (count > 0) {
+        const long bytes_read = pread(fd_file, buffer + offset, count, offset);
+        if (bytes_read <= 0)
+            return ERR_IO;
+        offset += bytes_read;
+        count -= bytes_read;
+    }
+    return 0;
+}
+
+//First page of task. Task border inside free run is moved to the end of run,
+//so every free run is trimmed by one thread.
+long task_start(long task) {
+    const long start = task * task_pages;
+    if (start >= total_pages)
+        return total_pages;
+    const long run = find_free_run(start);
+    if (run < free_runs_count && free_runs[run].start < start) {
+        const long run_finish = free_runs[run].start + free_runs[run].length;
+        return run_finish < total_pages ? run_finish : total_pages;
+    }
+    return start;
+}
+
+//Take the next task not done yet, -1 when all tasks are taken or the deadline is passed
+long stage2_next_task(void) {
+    while (1) {
+        const long index = __atomic_fetch_add(&next_task, 1, __ATOMIC_RELAXED);
+        if (index >= tasks_count || deadline_passed())
+            return -1;
+        const long task = task_order ? task_order[index] : index;
+        if (__atomic_load_n(&task_blocks[task], __ATOMIC_RELAXED) == TASK_NOT_DONE)
+            return task;
+    }
+}
+
+//FNV-1a hash of status file copy and manifest
+unsigned long fnv1a_checksum(const char *data, long length) {
+    unsigned long hash = 0xcbf29ce484222325UL;
+    for (long i = 0; i < length; i++) {
+        hash ^= (UCHAR) data[i];
+        hash *= 0x100000001b3UL;
+    }
+    return hash;
+}
+
+long status_file_copy_size(long tasks) {
+    return (long) sizeof(struct status_file_header) + 2 * tasks * (long) sizeof(long);
+}
+
+//Read the newest valid copy of status file into *header and allocated *tasks:
+//blocks for trim of tasks, then the first pages of tasks
+int status_file_read(int fd_status, struct status_file_header *header, long **tasks) {
+    struct stat status_stat;
+    int err = ERR_INCMP;
+
+    if (fstat(fd_status, &status_stat) != 0) {
+        fprintf(stderr, "Error read status file\n");
+        return ERR_IO;
+    }
+    const long copy_size = status_stat.st_size / 2;
+    if (status_stat.st_size % 2 || copy_size < (long) sizeof(struct status_file_header) ||
+        (copy_size - sizeof(struct status_file_header)) % (2 * sizeof(long))) {
+        fprintf(stderr, "Wrong size of status file %ld\n", (long) status_stat.st_size);
+        return ERR_INCMP;
+    }
+    char *copy = malloc(copy_size);
+    if (copy == NULL) {
+        fprintf(stderr, "Error allocating memory for status file\n");
+        return ERR_MEM;
+    }
+    *tasks = NULL;
+    for (int i = 0; i < 2; i++) {
+        struct status_file_header copy_header;
+        if (pread(fd_status, copy, copy_size, i * copy_size) != copy_size) {
+            fprintf(stderr, "Error read status file\n");
+            err = ERR_IO;
+            break;
+        }
+        memcpy(&copy_header, copy, sizeof(copy_header));
+        if (memcmp(copy_header.magic, STATUS_FILE_MAGIC, sizeof(copy_header.magic)) != 0)
+            continue;
+        if (copy_header.version != VER_STATUS_FILE) {
+            fprintf(stderr, "Incompatible version status file %d\n", copy_header.version);
+            err = ERR_INCMP;
+            break;
+        }
+        if (copy_header.tasks_count < 0 || status_file_copy_size(copy_header.tasks_count) != copy_size)
+            continue;
+        memset(copy + offsetof(struct status_file_header, checksum), 0, sizeof(copy_header.checksum));
+        if (fnv1a_checksum(copy, copy_size) != copy_header.checksum) {
+            if (log_level >= 2)
+                fprintf(stdout, "Copy %d of status file is damaged\n", i);
+            continue;
+        }
+        if (*tasks && copy_header.sequence <= header->sequence)
+            continue;
+        if (*tasks == NULL && (*tasks = malloc(copy_size - sizeof(copy_header))) == NULL) {
+            fprintf(stderr, "Error allocating memory for status file\n");
+            err = ERR_MEM;
+            break;
+        }
+        *header = copy_header;
+        memcpy(*tasks, copy + sizeof(copy_header), copy_size - sizeof(copy_header));
+        err = 0;
+    }
+    free(copy);
+    if (err) {
+        free(*tasks);
+        *tasks = NULL;
+    } else if (*tasks == NULL) {
+        fprintf(stderr, "Status file has no valid checkpoint\n");
+        err = ERR_INCMP;
+    }
+    return err;
+}
+
+//Check that status file is saved for the same database and options, tasks are done by any threads count
+int status_file_check(const struct status_file_header *header, const long *tasks) {
+    const long max_task_blocks = task_pages * (header_page.hdr_page_size / block_size);
+
+    if (header->page_size != header_page.hdr_page_size || header->total_pages != total_pages) {
+        fprintf(stderr, "Status file is saved for %ld pages of size %d, database has %ld pages of size %d\n",
+                header->total_pages, header->page_size, total_pages, header_page.hdr_page_size);
+        return ERR_INCMP;
+    }
+    if (header->task_pages != task_pages || header->tasks_count != tasks_count) {
+        fprintf(stderr, "Status file has %ld tasks of %ld pages, must be %ld tasks of %ld pages\n",
+                header->tasks_count, header->task_pages, tasks_count, task_pages);
+        return ERR_INCMP;
+    }
+    if (header->block_size != block_size) {
+        fprintf(stderr, "Status file is saved with block size %d, not %d\n", header->block_size, block_size);
+        return ERR_INCMP;
+    }
+    //Tasks done in dry run are not trimmed
+    if (trim && !header->trim) {
+        fprintf(stderr, "Status file is saved in dry run mode, can't continue with trim\n");
+        return ERR_INCMP;
+    }
+    for (long task = 0; task < tasks_count; task++) {
+        if (tasks[task] != TASK_NOT_DONE && (tasks[task] < 0 || tasks[task] > max_task_blocks)) {
+            fprintf(stderr, "Status file has wrong blocks for trim %ld of task %ld\n", tasks[task], task);
+            return ERR_INCMP;
+        }
+    }
+    return 0;
+}
+
+//Write checkpoint over the older copy of status file and flush it, called under mutex_checkpoint
+int status_file_write(void) {
+    struct status_file_header *header = (struct status_file_header *) checkpoint_buffer;
+    long *tasks = (long *) (checkpoint_buffer + sizeof(*header));
+    long *starts = tasks + tasks_count;
+    const long copy_size = status_file_copy_size(tasks_count);
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, STATUS_FILE_MAGIC, sizeof(header->magic));
+    header->version = VER_STATUS_FILE;
+    header->threads_count = threads_count;
+    header->sequence = ++checkpoint_sequence;
+    header->total_pages = total_pages;
+    header->task_pages = task_pages;
+    header->tasks_count = tasks_count;
+    header->page_size = header_page.hdr_page_size;
+    header->block_size = block_size;
+    header->trim = trim;
+    for (long task = 0; task < tasks_count; task++) {
+        tasks[task] = __atomic_load_n(&task_blocks[task], __ATOMIC_ACQUIRE);
+        starts[task] = task_start(task);
+    }
+    header->checksum = fnv1a_checksum(checkpoint_buffer, copy_size);
+    const long bytes_written = pwrite(fd_status_file, checkpoint_buffer, copy_size,
+                                      (header->sequence % 2) * copy_size);
+    if (bytes_written != copy_size) {
+        fprintf(stderr, "Error write data in status file. Writen %ld, must %ld\n", bytes_written, copy_size);
+        return ERR_IO;
+    }
+    if (fdatasync(fd_status_file) != 0) {
+        fprintf(stderr, "Error %d sync status file\n", errno);
+        return ERR_IO;
+    }
+    return 0;
+}
+
+//Count pages of done task and save checkpoint if there are checkpoint_pages of them
+//or checkpoint_interval is expired. Threads don't wait for checkpoint written by other thread.
+int status_file_checkpoint(long pages, int force) {
+    int mutex_status;
+
+    if (!fd_status_file)
+        return 0;
+    const long pending = __atomic_add_fetch(&checkpoint_pending_pages, pages, __ATOMIC_RELAXED);
+    const long now = monotonic_seconds();
+    if (!force) {
+        if (pending < checkpoint_pages &&
+            now - __atomic_load_n(&checkpoint_time, __ATOMIC_RELAXED) < checkpoint_interval)
+            return 0;
+        if (pthread_mutex_trylock(&mutex_checkpoint) != 0)
+            return 0;
+    } else if ((mutex_status = pthread_mutex_lock(&mutex_checkpoint)) != 0) {
+        fprintf(stderr, "Error %d lock checkpoint mutex\n", mutex_status);
+        return ERR_MUTEX;
+    }
+    __atomic_store_n(&checkpoint_pending_pages, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&checkpoint_time, now, __ATOMIC_RELAXED);
+    const int err = status_file_write();
+    mutex_status = pthread_mutex_unlock(&mutex_checkpoint);
+    if (mutex_status != 0) {
+        fprintf(stderr, "Error %d unlock checkpoint mutex\n", mutex_status);
+        return ERR_MUTEX;
+    }
+    return err;
+}
+
+//Add to counter of the current thread, it is the only writer
+void stage2_count(long *counter, long value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+//Page SCN is in page header since ODS12
+int is_scn_supported(void) {
+    return (header_page.hdr_ods_version & 0xFF) >= 12;
+}
+
+//Load manifest of the previous run for incremental stage 2
+int manifest_read(void) {
+    struct manifest_header header;
+    char message[128];
+    int fd_manifest = open(manifest_filename, O_RDONLY);
+
+    if (fd_manifest < 0) {
+        mylog(1, "Manifest is not found, full stage 2\n");
+        return 0;
+    }
+    if (read(fd_manifest, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Error read manifest %s\n", manifest_filename);
+        close(fd_manifest);
+        return ERR_IO;
+    }
+    if (header.version != VER_MANIFEST_FILE) {
+        fprintf(stderr, "Incompatible version manifest %d\n", header.version);
+        close(fd_manifest);
+        return ERR_INCMP;
+    }
+    if (header.page_size != header_page.hdr_page_size || header.ods_version != header_page.hdr_ods_version ||
+        header.tasks_count < 0) {
+        fprintf(stderr, "Manifest is saved for another database\n");
+        close(fd_manifest);
+        return ERR_INCMP;
+    }
+    //Free blocks of skipped pages are trimmed only by trim run with the same block size
+    if (!header.trim || header.block_size != block_size) {
+        fprintf(stderr, "Manifest is not saved by trim run with block size %d\n", block_size);
+        close(fd_manifest);
+        return ERR_INCMP;
+    }
+    const long tasks_size = header.tasks_count * (long) sizeof(ULONG);
+    char *manifest = malloc(sizeof(header) + tasks_size);
+    if (manifest == NULL) {
+        fprintf(stderr, "Error allocating memory for manifest\n");
+        close(fd_manifest);
+        return ERR_MEM;
+    }
+    const long bytes_read = pread(fd_manifest, manifest + sizeof(header), tasks_size, sizeof(header));
+    close(fd_manifest);
+    const unsigned long checksum = header.checksum;
+    header.checksum = 0;
+    memcpy(manifest, &header, sizeof(header));
+    if (bytes_read != tasks_size || fnv1a_checksum(manifest, sizeof(header) + tasks_size) != checksum) {
+        fprintf(stderr, "Manifest %s is damaged\n", manifest_filename);
+        free(manifest);
+        return ERR_INCMP;
+    }
+    manifest_task_scn = malloc(tasks_size > 0 ? tasks_size : 1);
+    if (manifest_task_scn == NULL) {
+        fprintf(stderr, "Error allocating memory for manifest\n");
+        free(manifest);
+        return ERR_MEM;
+    }
+    memcpy(manifest_task_scn, manifest + sizeof(header), tasks_size);
+    free(manifest);
+    manifest_tasks_count = header.tasks_count;
+    manifest_scn = header.max_scn;
+    sprintf(message, "Loaded manifest, pages with SCN less than %u are skipped\n", manifest_scn);
+    mylog(1, message);
+    return 0;
+}
+
+//Write file to temporary file, then rename it, so the old file stays whole if writing is interrupted
+int write_file_atomic(const char *filename, const char *data, long size) {
+    char temp_filename[strlen(filename) + 5];
+    int err = 0;
+
+    sprintf(temp_filename, "%s.tmp", filename);
+    const int fd_file = open(temp_filename, O_CREAT | O_TRUNC | O_WRONLY, 00660);
+    if (fd_file < 0) {
+        fprintf(stderr, "Error %d open file %s\n", fd_file, temp_filename);
+        return ERR_IO;
+    }
+    while (size > 0) {
+        const long bytes_written = write(fd_file, data, size);
+        if (bytes_written <= 0) {
+            err = ERR_IO;
+            break;
+        }
+        data += bytes_written;
+        size -= bytes_written;
+    }
+    if (err || fdatasync(fd_file) != 0) {
+        fprintf(stderr, "Error write file %s\n", temp_filename);
+        err = ERR_IO;
+    }
+    close(fd_file);
+    if (!err && rename(temp_filename, filename) != 0) {
+        fprintf(stderr, "Error %d rename file %s\n", errno, temp_filename);
+        err = ERR_IO;
+    }
+    return err;
+}
+
+//Save manifest after full stage 2 with trim
+int manifest_write(void) {
+    struct manifest_header *header;
+    char message[128];
+    const long tasks_size = tasks_count * (long) sizeof(ULONG);
+    const long manifest_size = (long) sizeof(*header) + tasks_size;
+
+    char *manifest = calloc(1, manifest_size);
+    if (manifest == NULL) {
+        fprintf(stderr, "Error allocating memory for manifest\n");
+        return ERR_MEM;
+    }
+    header = (struct manifest_header *) manifest;
+    memcpy(header->magic, MANIFEST_MAGIC, sizeof(header->magic));
+    header->version = VER_MANIFEST_FILE;
+    header->page_size = header_page.hdr_page_size;
+    header->ods_version = header_page.hdr_ods_version;
+    header->total_pages = total_pages;
+    header->task_pages = task_pages;
+    header->tasks_count = tasks_count;
+    header->block_size = block_size;
+    header->trim = 1;
+    for (long task = 0; task < tasks_count; task++) {
+        if (task_scn[task] > header->max_scn)
+            header->max_scn = task_scn[task];
+    }
+    memcpy(manifest + sizeof(*header), task_scn, tasks_size);
+    header->checksum = fnv1a_checksum(manifest, manifest_size);
+
+    const int err = write_file_atomic(manifest_filename, manifest, manifest_size);
+    if (!err) {
+        sprintf(message, "Saved manifest, max SCN %u\n", header->max_scn);
+        mylog(1, message);
+    }
+    free(manifest);
+    return err;
+}
+
+int plan_add(struct plan_pages *plan, const struct page_header *page_header, long page_num, unsigned long free_bits) {
+    if (plan->count == plan->allocated) {
+        const long allocated = plan->allocated ? plan->allocated * 2 : 1024;
+        struct plan_page *pages = realloc(plan->pages, allocated * sizeof(struct plan_page));
+        if (pages == NULL) {
+            fprintf(stderr, "Error allocating memory for plan\n");
+            return ERR_MEM;
+        }
+        plan->pages = pages;
+        plan->allocated = allocated;
+    }
+    struct plan_page *plan_page = &plan->pages[plan->count++];
+    memset(plan_page, 0, sizeof(*plan_page));
+    plan_page->page_num = page_num;
+    plan_page->generation = page_header->pag_generation;
+    plan_page->scn = page_header->pag_scn;
+    plan_page->page_type = page_header->page_type;
+    plan_page->free_bits = free_bits;
+    return 0;
+}
+
+int plan_page_compare(const void *a, const void *b) {
+    const ULONG page_a = ((const struct plan_page *) a)->page_num;
+    const ULONG page_b = ((const struct plan_page *) b)->page_num;
+    return page_a < page_b ? -1 : page_a > page_b;
+}
+
+//Save pages of all threads to plan file sorted by page number
+int plan_write(void) {
+    struct plan_header *header;
+    char message[128];
+    long pages_count = 0;
+
+    for (int thread = 0; thread < threads_count; thread++) {
+        pages_count += plan_thread[thread].count;
+    }
+    const long plan_size = (long) sizeof(*header) + pages_count * (long) sizeof(struct plan_page);
+    char *plan = calloc(1, plan_size);
+    if (plan == NULL) {
+        fprintf(stderr, "Error allocating memory for plan\n");
+        return ERR_MEM;
+    }
+    header = (struct plan_header *) plan;
+    struct plan_page *pages = (struct plan_page *) (plan + sizeof(*header));
+    memcpy(header->magic, PLAN_MAGIC, sizeof(header->magic));
+    header->version = VER_PLAN_FILE;
+    header->page_size = header_page.hdr_page_size;
+    header->block_size = block_size;
+    header->ods_version = header_page.hdr_ods_version;
+    header->total_pages = total_pages;
+    header->pages_count = pages_count;
+    pages_count = 0;
+    for (int thread = 0; thread < threads_count; thread++) {
+        memcpy(pages + pages_count, plan_thread[thread].pages, plan_thread[thread].count * sizeof(struct plan_page));
+        pages_count += plan_thread[thread].count;
+    }
+    qsort(pages, pages_count, sizeof(struct plan_page), plan_page_compare);
+    header->checksum = fnv1a_checksum(plan, plan_size);
+    const int err = write_file_atomic(plan_save_filename, plan, plan_size);
+    if (!err) {
+        char plan_size_str[32];
+        byte2str(plan_size_str, plan_size);
+        sprintf(message, "Saved plan, pages %ld (%s)\n", pages_count, plan_size_str);
+        mylog(1, message);
+    }
+    free(plan);
+    return err;
+}
+
+//Track max SCN of task, returns 1 when page is not changed after the manifest and is skipped
+int stage2_page_unchanged(struct status *arg, const char *page) {
+    const ULONG scn = ((const struct page_header *) page)->pag_scn;
+
+    if (scn > arg->max_scn)
+        arg->max_scn = scn;
+    if (scn < manifest_scn) {
+        stage2_count(&stage2_stats[arg->thread_number].pages_unchanged, 1);
+        return 1;
+    }
+    return 0;
+}
+
+//Task is done: save its result for checkpoint
+int stage2_task_done(const struct status *arg, long task, long blocks) {
+    __atomic_store_n(&task_blocks[task], blocks, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&tasks_done, 1, __ATOMIC_RELAXED);
+    return status_file_checkpoint(arg->finish - arg->start, 0);
+}
+
+void seconds2str(char *string, long seconds) {
+    sprintf(string, "%ld:%02ld:%02ld", seconds / 3600, seconds / 60 % 60, seconds % 60);
+}
+
+//Print one line of stage 2 progress from counters of threads
+void stage2_progress_print(double elapsed, double interval, long *bytes_read_prev, long *thread_bytes_prev) {
+    const USHORT page_size = header_page.hdr_page_size;
+    char line[4096];
+    char db_size[32];
+    char processed_size[32];
+    char blocks_size[32];
+    char eta[32];
+    long pages_done = 0;
+    long bytes_read = 0;
+    long blocks = 0;
+
+    for (int thread = 0; thread < threads_count; thread++) {
+        pages_done += __atomic_load_n(&stage2_stats[thread].pages_done, __ATOMIC_RELAXED);
+        bytes_read += __atomic_load_n(&stage2_stats[thread].bytes_read, __ATOMIC_RELAXED);
+        blocks += __atomic_load_n(&stage2_stats[thread].blocks, __ATOMIC_RELAXED);
+    }
+    long processed = progress_resumed_pages + pages_done;
+    if (processed > total_pages)
+        processed = total_pages;
+    byte2str(db_size, total_pages * page_size);
+    byte2str(processed_size, processed * page_size);
+    byte2str(blocks_size, blocks * block_size);
+    if (pages_done > 0 && elapsed > 0)
+        seconds2str(eta, (long) ((double) (total_pages - processed) * elapsed / (double) pages_done));
+    else
+        strcpy(eta, "-");
+    int length = sprintf(line, "\rProcessed bytes %s / %s (%ld%%), read %.1f MiB/s, found %s, ETA %s",
+                         processed_size, db_size, total_pages > 0 ? 100 * processed / total_pages : 100,
+                         interval > 0 ? (double) (bytes_read - *bytes_read_prev) / 1048576 / interval : 0,
+                         blocks_size, eta);
+    *bytes_read_prev = bytes_read;
+    //Read speed of every thread, MiB/s
+    if (threads_count > 1) {
+        length += sprintf(line + length, ", threads");
+        for (int thread = 0; thread < threads_count; thread++) {
+            const long thread_bytes = __atomic_load_n(&stage2_stats[thread].bytes_read, __ATOMIC_RELAXED);
+            length += sprintf(line + length, " %.0f",
+                              interval > 0 ? (double) (thread_bytes - thread_bytes_prev[thread]) / 1048576 / interval : 0);
+            thread_bytes_prev[thread] = thread_bytes;
+        }
+    }
+    //Clear the tail of longer previous line
+    fprintf(stdout, "%s\033[K", line);
+    fflush(stdout);
+}
+
+//Progress reporter thread: prints progress of stage 2 every PROGRESS_INTERVAL_MS until progress_stop
+void * stage2_progress(void *argv) {
+    struct timespec started, previous, now, wakeup;
+    long bytes_read_prev = 0;
+    long thread_bytes_prev[MAX_THREADS] = {0};
+    (void) argv;
+    int stop = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    previous = started;
+    pthread_mutex_lock(&mutex_progress);
+    while (!stop) {
+        clock_gettime(CLOCK_REALTIME, &wakeup);
+        wakeup.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+        wakeup.tv_sec += wakeup.tv_nsec / 1000000000L;
+        wakeup.tv_nsec %= 1000000000L;
+        while (!progress_stop && pthread_cond_timedwait(&cond_progress, &mutex_progress, &wakeup) == 0);
+        stop = progress_stop;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const double elapsed = (double) (now.tv_sec - started.tv_sec) + (double) (now.tv_nsec - started.tv_nsec) / 1e9;
+        const double interval = (double) (now.tv_sec - previous.tv_sec) + (double) (now.tv_nsec - previous.tv_nsec) / 1e9;
+        previous = now;
+        stage2_progress_print(elapsed, interval, &bytes_read_prev, thread_bytes_prev);
+    }
+    pthread_mutex_unlock(&mutex_progress);
+    return 0;
+}
+
+//Next range of pages for stage 2 thread from chunk_start: free run, hole or allocated pages for one read.
+//Returns the end of range, *range_type is RANGE_FREE for free run, RANGE_HOLE for allocated pages in hole.
+#define RANGE_READ 0
+#define RANGE_FREE 1
+#define RANGE_HOLE 2
+long stage2_next_range(const struct status *arg, long chunk_start, long chunk_pages, long *run, int *range_type) {
+    long chunk_finish;
+    //Skip pages found free on stage 1, they are not read
+    if (*run < free_runs_count && free_runs[*run].start <= chunk_start) {
+        const long run_finish = free_runs[*run].start + free_runs[*run].length;
+        (*run)++;
+        *range_type = RANGE_FREE;
+        return run_finish < arg->finish ? run_finish : arg->finish;
+    }
+    //Read allocated pages up to the chunk size, the next free run or hole
+    chunk_finish = chunk_start + chunk_pages < arg->finish ? chunk_start + chunk_pages : arg->finish;
+    if (*run < free_runs_count && free_runs[*run].start < chunk_finish)
+        chunk_finish = free_runs[*run].start;
+    *range_type = RANGE_READ;
+    if (holes_count) {
+        const long hole = find_hole(chunk_start);
+        if (hole < holes_count && holes[hole].start <= chunk_start) {
+            //Pages in hole are zeros, nothing to read
+            const long hole_finish = holes[hole].start + holes[hole].length;
+            *range_type = RANGE_HOLE;
+            return hole_finish < chunk_finish ? hole_finish : chunk_finish;
+        }
+        if (hole < holes_count && holes[hole].start < chunk_finish)
+            chunk_finish = holes[hole].start;
+    }
+    return chunk_finish;
+}
+
+#ifdef HAVE_IO_URING
+//Minimal io_uring engine on raw system calls: chunk reads into registered buffers and fallocate
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    int fallocate_supported;
+    unsigned in_flight;
+    unsigned punches_in_flight;
+    //Reads of slot not completed yet and result: bytes read by chunk read, negative error
+    int slot_pending[MAX_IO_URING_DEPTH];
+    long slot_result[MAX_IO_URING_DEPTH];
+};
+
+#define URING_ENTRIES 256
+//user_data of fallocate requests, reads use slot number
+#define URING_PUNCH (~0ULL)
+
+void uring_free(struct uring *ring) {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return ERR_IO;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        uring_free(ring);
+        return ERR_IO;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            uring_free(ring);
+            return ERR_IO;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_free(ring);
+        return ERR_IO;
+    }
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+
+    //IORING_OP_FALLOCATE appeared in Linux 5.6, older kernels get synchronous fallocate
+    const size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        ring->fallocate_supported = probe->last_op >= IORING_OP_FALLOCATE &&
+                                    (probe->ops[IORING_OP_FALLOCATE].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return 0;
+}
+
+//Free submission entry or NULL when submission queue is full
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+        return NULL;
+    const unsigned index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+//Submit queued entries and wait for wait_count completions.
+//Kernel may take a part of entries, they are counted from sq_head, so the rest is submitted again.
+int uring_submit(struct uring *ring, unsigned wait_count) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (1) {
+        const unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        const long submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_count,
+                                       wait_count ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted < 0 && errno == EINTR)
+            continue;
+        if (submitted < 0 || (submitted == 0 && to_submit > 0))
+            return ERR_IO;
+        if ((unsigned long) submitted >= to_submit)
+            return 0;
+    }
+}
+
+//Next completion or NULL, call uring_cqe_seen() after use
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    const unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+//Reap completions: count finished reads of slots, check results of fallocate
+int uring_reap(struct uring *ring) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(ring)) != NULL) {
+        ring->in_flight--;
+        if (cqe->user_data == URING_PUNCH) {
+            ring->punches_in_flight--;
+            if (cqe->res < 0) {
+                uring_cqe_seen(ring);
+                return ERR_TRIM;
+            }
+        } else {
+            //Probe reads of one page header must be complete, chunk read may be short
+            const int slot = (int) cqe->user_data;
+            ring->slot_pending[slot]--;
+            if (cqe->res < 0)
+                ring->slot_result[slot] = cqe->res;
+            else if (!probe_pages)
+                ring->slot_result[slot] = cqe->res;
+            else if (cqe->res < block_size && ring->slot_result[slot] >= 0)
+                ring->slot_result[slot] = -EIO;
+        }
+        uring_cqe_seen(ring);
+    }
+    return 0;
+}
+
+//Submission entry for the next request, NULL on error.
+//Requests in flight never exceed the ring size, so completion queue can't overflow.
+struct io_uring_sqe *uring_next_sqe(struct uring *ring) {
+    struct io_uring_sqe *sqe;
+    while (1) {
+        if (ring->in_flight < URING_ENTRIES && (sqe = uring_get_sqe(ring)) != NULL) {
+            ring->in_flight++;
+            return sqe;
+        }
+        if (uring_submit(ring, ring->in_flight >= URING_ENTRIES ? 1 : 0) || uring_reap(ring))
+            return NULL;
+    }
+}
+
+//Wait for all queued fallocate calls
+int uring_drain(struct uring *ring) {
+    while (ring->punches_in_flight > 0) {
+        if (uring_submit(ring, 1))
+            return ERR_IO;
+        if (uring_reap(ring))
+            return ERR_TRIM;
+    }
+    return 0;
+}
+
+//Queue fallocate, completion is checked in uring_reap()
+int uring_punch(struct uring *ring, long offset, long length) {
+    struct io_uring_sqe *sqe = uring_next_sqe(ring);
+    if (sqe == NULL)
+        return ERR_TRIM;
+    sqe->opcode = IORING_OP_FALLOCATE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = length;
+    sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    sqe->user_data = URING_PUNCH;
+    ring->punches_in_flight++;
+    return 0;
+}
+#else
+struct uring;
+#endif
+
+//Trim part of page, through io_uring when it is used by thread.
+//Latency is measured for synchronous calls only.
+int stage2_trim(struct uring *ring, struct latency_histogram *latency, long offset, long length) {
+    struct timespec started;
+
+    limit_punch(length);
+#ifdef HAVE_IO_URING
+    if (ring && ring->fallocate_supported) {
+        if (uring_punch(ring, offset, length)) {
+            fprintf(stderr, "fallocate failed\n");
+            return ERR_TRIM;
+        }
+        return 0;
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length)) {
+        fprintf(stderr, "fallocate failed\n");
+        return ERR_TRIM;
+    }
+    latency_add(latency, &started);
+    return 0;
+}
+
+//Range waiting for trim in stage 2 thread. Adjacent ranges are joined, so free tail blocks of page
+//and the following free pages of stage 1 are trimmed by one call.
+struct stage2_punch {
+    struct uring *ring;
+    struct log_ring *log;
+    struct plan_pages *plan;
+    struct stage2_stats *stats;
+    long offset;
+    long length;
+    long extents;
+};
+
+int stage2_punch_flush(struct stage2_punch *punch) {
+    long offset = punch->offset;
+    long length = punch->length;
+
+    if (punch->length == 0)
+        return 0;
+    if (punch_policy(punch->stats, &offset, &length)) {
+        punch->extents++;
+        if (log_level >= 3)
+            log_event(punch->log, LOG_TRIM_OFFSET, 0, offset, length, 0);
+        if (trim && stage2_trim(punch->ring, &punch->stats->fallocate_latency, offset, length))
+            return ERR_TRIM;
+        if (trim)
+            punch->stats->trimmed_bytes += length;
+    }
+    punch->offset += punch->length;
+    punch->length = 0;
+    return 0;
+}
+
+int stage2_punch_join(struct stage2_punch *punch, long offset, long length) {
+    if (punch->length && punch->offset + punch->length == offset) {
+        punch->length += length;
+    } else {
+        if (stage2_punch_flush(punch))
+            return ERR_TRIM;
+        punch->offset = offset;
+        punch->length = length;
+    }
+    //Extent size limit
+    while (max_extent_size && punch->length > max_extent_size) {
+        const long rest = punch->length - max_extent_size;
+        punch->length = max_extent_size;
+        if (stage2_punch_flush(punch))
+            return ERR_TRIM;
+        punch->length = rest;
+    }
+    return 0;
+}
+
+//Add range to trim, parts of range in holes are skipped
+int stage2_punch_add(struct stage2_punch *punch, long offset, long length) {
+    const USHORT page_size = header_page.hdr_page_size;
+
+    //Range of blocks inside read page can't be in hole
+    if (holes_count && length >= page_size) {
+        const long finish = offset + length;
+        for (long hole = find_hole(offset / page_size);
+             hole < holes_count && holes[hole].start * page_size < finish; hole++) {
+            const long hole_start = holes[hole].start * page_size > offset ? holes[hole].start * page_size : offset;
+            const long hole_finish = (holes[hole].start + holes[hole].length) * page_size;
+            if (hole_start > offset && stage2_punch_join(punch, offset, hole_start - offset))
+                return ERR_TRIM;
+            offset = hole_finish < finish ? hole_finish : finish;
+        }
+        if (offset >= finish)
+            return 0;
+        length = finish - offset;
+    }
+    return stage2_punch_join(punch, offset, length);
+}
+
+//Bitmap of all blocks of page
+unsigned long page_bitmap_fill;
+int block_shift;
+
+//Bits from low to high inclusive, high is less than 64
+__attribute__((always_inline)) static inline unsigned long bit_range(long low, long high) {
+    return (2UL << high) - (1UL << low);
+}
+
+//Stage 2: Analyze page filling, bitmap of used blocks.
+//Only page header and dpg_rpt array of data page are used.
+//Kernel is inlined with constant page size and block shift into every stage2_classify_* function.
+__attribute__((always_inline)) static inline
+unsigned long classify_page(const char *page, const long page_size, const int shift) {
+    const unsigned long fill = ~0UL >> (8 * sizeof(unsigned long) - (page_size >> shift));
+    const struct data_page *data_page;
+    const struct blob_page *blob_page;
+    const struct btree_page *btree_page;
+    unsigned long page_bitmap;  //MAX_PAGE_SIZE / min(block_size) = 32768 / 512 = 64 bit
+
+    switch (((const struct page_header *) page)->page_type) {
+        case PT_DATA: {
+            data_page = (const struct data_page *) page;
+            const long rpt_end = (long) (offsetof(struct data_page, dpg_rpt) + sizeof(struct dpg_repeat) * data_page->count);
+            //Broken page, keep it whole
+            if (rpt_end > page_size)
+                return fill;
+            page_bitmap = bit_range(0, (rpt_end < page_size ? rpt_end : page_size - 1) >> shift);
+            long broken = 0;
+            for (unsigned short cnt = 0; cnt < data_page->count; cnt++) {
+                const long offset = data_page->dpg_rpt[cnt].dpg_offset;
+                const long length = data_page->dpg_rpt[cnt].dpg_length;
+                //Empty record has no blocks, record out of page breaks page. Bits are masked to stay in range.
+                const unsigned long used = -(unsigned long) (length != 0);
+                broken |= (long) used & (offset + length > page_size);
+                page_bitmap |= used & bit_range((offset >> shift) & 63, ((offset + length - 1) >> shift) & 63);
+            }
+            return broken ? fill : page_bitmap;
+        }
+        case PT_B_TREE:
+            btree_page = (const struct btree_page *) page;
+            if (btree_page->btr_length >= page_size - (1L << shift))
+                return fill;
+            return bit_range(0, (btree_page->btr_length > (long) sizeof(struct btree_page) ?
+                                 btree_page->btr_length : (long) sizeof(struct btree_page)) >> shift);
+        case PT_BLOB:
+            blob_page = (const struct blob_page *) page;
+            if ((long) offsetof(struct blob_page, blp_page) + blob_page->blp_length >= page_size - (1L << shift))
+                return fill;
+            return bit_range(0, ((long) offsetof(struct blob_page, blp_page) + blob_page->blp_length) >> shift);
+        default:
+            return 0UL;
+    }
+}
+
+//Generic classifier for page and block sizes without their own kernel
+unsigned long stage2_classify_generic(const char *page) {
+    return classify_page(page, header_page.hdr_page_size, block_shift);
+}
+
+#define CLASSIFY_KERNEL(page_size, block_size, shift) \
+    unsigned long stage2_classify_##page_size##_##block_size(const char *page) { \
+        return classify_page(page, page_size, shift); \
+    }
+CLASSIFY_KERNEL(4096, 512, 9)
+CLASSIFY_KERNEL(4096, 4096, 12)
+CLASSIFY_KERNEL(8192, 512, 9)
+CLASSIFY_KERNEL(8192, 4096, 12)
+CLASSIFY_KERNEL(16384, 512, 9)
+CLASSIFY_KERNEL(16384, 4096, 12)
+CLASSIFY_KERNEL(32768, 512, 9)
+CLASSIFY_KERNEL(32768, 4096, 12)
+
+const struct classify_kernel {
+    USHORT page_size;
+    short block_size;
+    unsigned long (*classify)(const char *page);
+} classify_kernels[] = {
+        {4096, 512, stage2_classify_4096_512},
+        {4096, 4096, stage2_classify_4096_4096},
+        {8192, 512, stage2_classify_8192_512},
+        {8192, 4096, stage2_classify_8192_4096},
+        {16384, 512, stage2_classify_16384_512},
+        {16384, 4096, stage2_classify_16384_4096},
+        {32768, 512, stage2_classify_32768_512},
+        {32768, 4096, stage2_classify_32768_4096},
+};
+
+unsigned long (*stage2_classify)(const char *page) = stage2_classify_generic;
+
+//Bitmap of all blocks and classifier kernel for page size and block size
+void init_classify(void) {
+    const USHORT page_size = header_page.hdr_page_size;
+
+    page_bitmap_fill = -1;
+    page_bitmap_fill = page_bitmap_fill >> (8 * sizeof(page_bitmap_fill) - page_size / block_size);
+    block_shift = __builtin_ctz(block_size);
+    stage2_classify = stage2_classify_generic;
+    for (int kernel = 0; kernel < (int) (sizeof(classify_kernels) / sizeof(classify_kernels[0])); kernel++) {
+        if (classify_kernels[kernel].page_size == page_size && classify_kernels[kernel].block_size == block_size)
+            stage2_classify = classify_kernels[kernel].classify;
+    }
+}
+
+//Zero blocks detector: bitmap of blocks filled by zeros in the first size bytes of page.
+//Every block is checked until its first non-zero bytes, the implementation is chosen by init_zero_blocks().
+unsigned long zero_blocks_scalar(const char *page, long size) {
+    unsigned long bitmap = 0;
+    for (int block = 0; block * block_size < size; block++) {
+        const unsigned long *data = (const unsigned long *) (page + block * block_size);
+        const unsigned long *end = data + block_size / sizeof(unsigned long);
+        for (; data < end; data += 4) {
+            if (data[0] | data[1] | data[2] | data[3])
+                break;
+        }
+        if (data >= end)
+            bitmap |= 1UL << block;
+    }
+    return bitmap;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+unsigned long zero_blocks_sse2(const char *page, long size) {
+    const __m128i zero = _mm_setzero_si128();
+    unsigned long bitmap = 0;
+    for (int block = 0; block * block_size < size; block++) {
+        const char *data = page + block * block_size;
+        const char *end = data + block_size;
+        for (; data < end; data += 64) {
+            const __m128i value = _mm_or_si128(
+                    _mm_or_si128(_mm_loadu_si128((const __m128i *) data), _mm_loadu_si128((const __m128i *) (data + 16))),
+                    _mm_or_si128(_mm_loadu_si128((const __m128i *) (data + 32)), _mm_loadu_si128((const __m128i *) (data + 48))));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(value, zero)) != 0xFFFF)
+                break;
+        }
+        if (data >= end)
+            bitmap |= 1UL << block;
+    }
+    return bitmap;
+}
+
+__attribute__((target("avx2")))
+unsigned long zero_blocks_avx2(const char *page, long size) {
+    unsigned long bitmap = 0;
+    for (int block = 0; block * block_size < size; block++) {
+        const char *data = page + block * block_size;
+        const char *end = data + block_size;
+        for (; data < end; data += 128) {
+            const __m256i value = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_loadu_si256((const __m256i *) data), _mm256_loadu_si256((const __m256i *) (data + 32))),
+                    _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (data + 64)), _mm256_loadu_si256((const __m256i *) (data + 96))));
+            if (!_mm256_testz_si256(value, value))
+                break;
+        }
+        if (data >= end)
+            bitmap |= 1UL << block;
+    }
+    return bitmap;
+}
+#endif
+
+unsigned long (*zero_blocks)(const char *page, long size) = zero_blocks_scalar;
+
+void init_zero_blocks(void) {
+    const char *name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        zero_blocks = zero_blocks_avx2;
+        name = "AVX2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        zero_blocks = zero_blocks_sse2;
+        name = "SSE2";
+    }
+#endif
+    if (log_level >= 2) {
+        char message[128];
+        sprintf(message, "Zero blocks detector %s\n", name);
+        mylog(2, message);
+    }
+}
+
+//Bitmap of used blocks: blocks used by stage2_classify() without zero blocks.
+//Page of other types is used whole, but its zero blocks are free too. probed is bytes of page in memory.
+unsigned long stage2_used_blocks(const char *page, long probed) {
+    unsigned long page_bitmap = stage2_classify(page);
+    if (page_bitmap == 0)
+        page_bitmap = page_bitmap_fill;
+    return page_bitmap & ~zero_blocks(page, probed);
+}
+
+//Bytes at the start of page needed by stage2_classify()
+long stage2_probe_size(const char *page) {
+    const struct data_page *data_page = (const struct data_page *) page;
+    const USHORT page_size = header_page.hdr_page_size;
+
+    if (data_page->header.page_type != PT_DATA)
+        return block_size;
+    long size = (long) (offsetof(struct data_page, dpg_rpt) + sizeof(struct dpg_repeat) * data_page->count);
+    if (size > page_size)
+        return block_size;
+    return (size + block_size - 1) / block_size * block_size;
+}
+
+//Read the first block of every page in chunk, each page is placed at its offset in chunk
+int stage2_probe_chunk(char *chunk, long chunk_start, long chunk_finish) {
+    const USHORT page_size = header_page.hdr_page_size;
+    for (long page_num = chunk_start; page_num < chunk_finish; page_num++) {
+        if (read_full(chunk + (page_num - chunk_start) * page_size, block_size, page_num * page_size))
+            return ERR_IO;
+    }
+    return 0;
+}
+
+//Read the rest of dpg_rpt array, when it is longer than the first block.
+//Returns bytes of page in memory or -1 on error.
+long stage2_probe_extend(char *page, long page_num) {
+    const USHORT page_size = header_page.hdr_page_size;
+    const long size = stage2_probe_size(page);
+
+    if (size > block_size && read_full(page + block_size, size - block_size, page_num * page_size + block_size))
+        return -1;
+    return size;
+}
+
+//Index of page type in arrays by page type, unknown types are counted as undefined
+int page_type_index(SCHAR page_type) {
+    return page_type > 0 && page_type <= MAX_PAGE_TYPE ? page_type : PT_UNDEFINED_PAGE;
+}
+
+//Trim free blocks of page, every run of set bits by one call
+int stage2_punch_bits(struct stage2_punch *punch, long page_num, unsigned long free_bits, long *blocks_for_trim_thr) {
+    const USHORT page_size = header_page.hdr_page_size;
+
+    while (free_bits) {
+        const int low_bit = __builtin_ctzl(free_bits);
+        const unsigned long used_above = ~(free_bits >> low_bit);
+        const int blocks = used_above ? __builtin_ctzl(used_above) : 64 - low_bit;
+        *blocks_for_trim_thr += blocks;
+        if (stage2_punch_add(punch, page_num * page_size + low_bit * block_size, (long) blocks * block_size))
+            return ERR_TRIM;
+        free_bits &= free_bits + (1UL << low_bit);
+    }
+    return 0;
+}
+
+//Slot of object with key, or empty slot for it
+struct object_stats *object_slot(const struct object_table *table, ULONG key) {
+    unsigned long slot = ((unsigned long) key * 0x9e3779b97f4a7c15UL) >> 32;
+    while (1) {
+        slot &= table->size - 1;
+        if (table->slots[slot].pages == 0 || table->slots[slot].key == key)
+            return &table->slots[slot];
+        slot++;
+    }
+}
+
+//Table is grown twice when it is half full
+int object_table_grow(struct object_table *table) {
+    const long size = table->size ? table->size * 2 : 256;
+    struct object_table grown = {calloc(size, sizeof(struct object_stats)), table->count, size};
+
+    if (grown.slots == NULL) {
+        fprintf(stderr, "Error allocating memory for objects\n");
+        return ERR_MEM;
+    }
+    for (long slot = 0; slot < table->size; slot++) {
+        if (table->slots[slot].pages)
+            *object_slot(&grown, table->slots[slot].key) = table->slots[slot];
+    }
+    free(table->slots);
+    *table = grown;
+    return 0;
+}
+
+//Object of key, it is added when it is not found. Returns NULL on error.
+struct object_stats *object_get(struct object_table *table, ULONG key) {
+    if (2 * table->count >= table->size && object_table_grow(table))
+        return NULL;
+    struct object_stats *object = object_slot(table, key);
+    if (object->pages == 0) {
+        object->key = key;
+        table->count++;
+    }
+    return object;
+}
+
+//Count data page of relation or b-tree page of index. page_bitmap is bitmap of used blocks.
+int objects_add(struct object_table *table, const char *page, unsigned long page_bitmap) {
+    const struct page_header *page_header = (const struct page_header *) page;
+    const USHORT page_size = header_page.hdr_page_size;
+    long used_bytes;
+    ULONG key;
+
+    if (page_header->page_type == PT_DATA) {
+        const struct data_page *data_page = (const struct data_page *) page;
+        key = (ULONG) data_page->relation << 16;
+        used_bytes = (long) (offsetof(struct data_page, dpg_rpt) + sizeof(struct dpg_repeat) * data_page->count);
+        for (unsigned short cnt = 0; cnt < data_page->count && used_bytes < page_size; cnt++) {
+            used_bytes += data_page->dpg_rpt[cnt].dpg_length;
+        }
+    } else if (page_header->page_type == PT_B_TREE) {
+        const struct btree_page *btree_page = (const struct btree_page *) page;
+        key = (ULONG) btree_page->btr_relation << 16 | OBJECT_INDEX | btree_page->btr_id;
+        used_bytes = btree_page->btr_length;
+    } else {
+        return 0;
+    }
+    if (used_bytes > page_size)
+        used_bytes = page_size;
+
+    struct object_stats *object = object_get(table, key);
+    if (object == NULL)
+        return ERR_MEM;
+    object->pages++;
+    object->used_bytes += used_bytes;
+    object->free_blocks += __builtin_popcountl(~page_bitmap & page_bitmap_fill);
+    object->fill[used_bytes * OBJECT_FILL_BUCKETS / page_size < OBJECT_FILL_BUCKETS ?
+                 used_bytes * OBJECT_FILL_BUCKETS / page_size : OBJECT_FILL_BUCKETS - 1]++;
+    return 0;
+}
+
+//Merge objects of thread table into total table, thread table is freed
+int objects_merge(struct object_table *total, struct object_table *table) {
+    int err = 0;
+
+    for (long slot = 0; slot < table->size && !err; slot++) {
+        const struct object_stats *other = &table->slots[slot];
+        if (other->pages == 0)
+            continue;
+        struct object_stats *object = object_get(total, other->key);
+        if (object == NULL) {
+            err = ERR_MEM;
+            break;
+        }
+        object->pages += other->pages;
+        object->used_bytes += other->used_bytes;
+        object->free_blocks += other->free_blocks;
+        for (int bucket = 0; bucket < OBJECT_FILL_BUCKETS; bucket++) {
+            object->fill[bucket] += other->fill[bucket];
+        }
+    }
+    free(table->slots);
+    memset(table, 0, sizeof(struct object_table));
+    return err;
+}
+
+//Objects with more unused bytes first, they get more space by sweep or index rebuild
+int object_compare_unused(const void *a, const void *b) {
+    const struct object_stats *object_a = a;
+    const struct object_stats *object_b = b;
+    const USHORT page_size = header_page.hdr_page_size;
+    const long unused_a = object_a->pages * page_size - object_a->used_bytes;
+    const long unused_b = object_b->pages * page_size - object_b->used_bytes;
+
+    if (unused_a != unused_b)
+        return unused_a < unused_b ? 1 : -1;
+    return object_a->key < object_b->key ? -1 : object_a->key > object_b->key;
+}
+
+//Objects of table are moved to its start and sorted, slots are not usable for search after it
+void objects_sort(struct object_table *table) {
+    long count = 0;
+    for (long slot = 0; slot < table->size; slot++) {
+        if (table->slots[slot].pages)
+            table->slots[count++] = table->slots[slot];
+    }
+    qsort(table->slots, count, sizeof(struct object_stats), object_compare_unused);
+}
+
+//Name of object: "relation N" or "relation N index M", M is RDB$INDEX_ID
+void object_name(char *string, const struct object_stats *object) {
+    if (object->key & OBJECT_INDEX)
+        sprintf(string, "relation %u index %u", object->key >> 16, (object->key & 0xff) + 1);
+    else
+        sprintf(string, "relation %u", object->key >> 16);
+}
+
+void objects_report(void) {
+    const USHORT page_size = header_page.hdr_page_size;
+    char message[512];
+    char name[48];
+    char size[32];
+    char unused[32];
+    char free_size[32];
+
+    mylog(1, "Objects: pages (size), average fill, unused bytes in pages, blocks for trim, fill histogram by 10%\n");
+    for (long object_index = 0; object_index < objects_total.count; object_index++) {
+        const struct object_stats *object = &objects_total.slots[object_index];
+        object_name(name, object);
+        byte2str(size, object->pages * page_size);
+        byte2str(unused, object->pages * page_size - object->used_bytes);
+        byte2str(free_size, object->free_blocks * block_size);
+        int length = sprintf(message, "Objects: %s: pages %ld (%s), fill %ld%%, unused %s, for trim %s, fill", name,
+                             object->pages, size, object->used_bytes * 100 / (object->pages * page_size), unused,
+                             free_size);
+        for (int bucket = 0; bucket < OBJECT_FILL_BUCKETS; bucket++) {
+            length += sprintf(message + length, " %ld", object->fill[bucket]);
+        }
+        sprintf(message + length, "\n");
+        mylog(1, message);
+    }
+}
+
+//Stage 2: Analyze page filling and trim unused blocks of one page.
+//probed is bytes at the start of page in memory, page_size when whole page is read.
+int stage2_page(struct stage2_punch *punch, char *page, long page_num, long probed, long *blocks_for_trim_thr) {
+    const struct page_header *page_header = (const struct page_header *) page;
+    const USHORT page_size = header_page.hdr_page_size;
+    char message[128];
+
+    unsigned long page_bitmap = stage2_used_blocks(page, probed);
+
+    //Page was probed, check it before trim: read whole page, the probed part must be the same
+    if (verify_pages && probed < page_size && page_bitmap < page_bitmap_fill) {
+        char probed_part[probed];
+        memcpy(probed_part, page, probed);
+        limit_wait(&read_limit, page_size);
+        if (read_full(page, page_size, page_num * page_size)) {
+            fprintf(stderr, "Error read page %ld\n", page_num);
+            return ERR_IO;
+        }
+        stage2_count(&punch->stats->bytes_read, page_size);
+        if (memcmp(probed_part, page, probed) != 0) {
+            if (log_level >= 2) {
+                sprintf(message, "Page %ld changed after probe, skipped\n", page_num);
+                mylog(2, message);
+            }
+            return 0;
+        }
+        page_bitmap = stage2_used_blocks(page, page_size);
+    }
+    if (objects_enabled && objects_add(&punch->stats->objects, page, page_bitmap))
+        return ERR_MEM;
+
+    //Trim blocks: every run of free blocks by one call, found from the complement of bitmap
+    if (page_bitmap < page_bitmap_fill) {
+        if (log_level >= 3)
+            log_event(punch->log, LOG_PAGE_BITMAP, page_header->page_type, page_num, (long) page_bitmap, 0);
+        const unsigned long free_bits = ~page_bitmap & page_bitmap_fill;
+        if (punch->plan && plan_add(punch->plan, page_header, page_num, free_bits))
+            return ERR_MEM;
+        punch->stats->page_type_blocks[page_type_index(page_header->page_type)] += __builtin_popcountl(free_bits);
+        return stage2_punch_bits(punch, page_num, free_bits, blocks_for_trim_thr);
+    }
+    return 0;
+}
+
+//Block size of plan from its header, 0 if it can't be read
+int plan_block_size(void) {
+    struct plan_header header;
+    const int fd_plan = open(plan_apply_filename, O_RDONLY);
+
+    if (fd_plan < 0)
+        return 0;
+    const long bytes_read = pread(fd_plan, &header, sizeof(header), 0);
+    close(fd_plan);
+    if (bytes_read != sizeof(header) || memcmp(header.magic, PLAN_MAGIC, sizeof(header.magic)) != 0)
+        return 0;
+    return header.block_size;
+}
+
+//Trim free blocks of plan pages, page is skipped when its header is changed after the plan is saved
+int plan_apply(void) {
+    const USHORT page_size = header_page.hdr_page_size;
+    struct stage2_punch punch = {NULL, NULL, NULL, &main_stats, 0, 0, 0};
+    struct plan_header header;
+    struct stat plan_stat;
+    char message[128];
+    char buf4size[32];
+    long blocks = 0;
+    long changed = 0;
+    int err = 0;
+
+    const int fd_plan = open(plan_apply_filename, O_RDONLY);
+    if (fd_plan < 0) {
+        fprintf(stderr, "Error %d open file %s\n", fd_plan, plan_apply_filename);
+        return ERR_IO;
+    }
+    if (fstat(fd_plan, &plan_stat) != 0 || plan_stat.st_size < (long) sizeof(header)) {
+        fprintf(stderr, "Error read plan %s\n", plan_apply_filename);
+        close(fd_plan);
+        return ERR_IO;
+    }
+    char *plan = malloc(plan_stat.st_size);
+    if (plan == NULL) {
+        fprintf(stderr, "Error allocating memory for plan\n");
+        close(fd_plan);
+        return ERR_MEM;
+    }
+    if (read_file(fd_plan, plan, plan_stat.st_size)) {
+        fprintf(stderr, "Error read plan %s\n", plan_apply_filename);
+        err = ERR_IO;
+    }
+    close(fd_plan);
+    memcpy(&header, plan, sizeof(header));
+    if (!err && (memcmp(header.magic, PLAN_MAGIC, sizeof(header.magic)) != 0 || header.version != VER_PLAN_FILE)) {
+        fprintf(stderr, "Incompatible plan file %s\n", plan_apply_filename);
+        err = ERR_INCMP;
+    }
+    if (!err && (header.pages_count < 0 ||
+                 plan_stat.st_size != (long) sizeof(header) + header.pages_count * (long) sizeof(struct plan_page))) {
+        fprintf(stderr, "Wrong size of plan file %s\n", plan_apply_filename);
+        err = ERR_INCMP;
+    }
+    if (!err) {
+        memset(plan + offsetof(struct plan_header, checksum), 0, sizeof(header.checksum));
+        if (fnv1a_checksum(plan, plan_stat.st_size) != header.checksum) {
+            fprintf(stderr, "Plan %s is damaged\n", plan_apply_filename);
+            err = ERR_INCMP;
+        }
+    }
+    if (!err && (header.page_size != page_size || header.ods_version != header_page.hdr_ods_version ||
+                 (header.block_size != 512 && header.block_size != 4096))) {
+        fprintf(stderr, "Plan is saved for another database\n");
+        err = ERR_INCMP;
+    }
+    if (err) {
+        free(plan);
+        return err;
+    }
+    //Bits of plan are blocks of its size
+    if (header.block_size != block_size) {
+        snprintf(message, sizeof(message), "Plan is saved with block size %d, it is used instead of %d\n",
+                 header.block_size, block_size);
+        mylog(1, message);
+    }
+    block_size = header.block_size;
+
+    const struct plan_page *pages = (const struct plan_page *) (plan + sizeof(header));
+    for (long i = 0; i < header.pages_count; i++) {
+        struct page_header page_header;
+        const long page_num = pages[i].page_num;
+        if (page_num >= total_pages ||
+            pread(fd, &page_header, sizeof(page_header), page_num * page_size) != sizeof(page_header) ||
+            page_header.page_type != pages[i].page_type || page_header.pag_generation != pages[i].generation ||
+            page_header.pag_scn != pages[i].scn) {
+            changed++;
+            continue;
+        }
+        main_stats.page_type_blocks[page_type_index(pages[i].page_type)] += __builtin_popcountl(pages[i].free_bits);
+        if ((err = stage2_punch_bits(&punch, page_num, pages[i].free_bits, &blocks)))
+            break;
+    }
+    if (!err && stage2_punch_flush(&punch))
+        err = ERR_TRIM;
+    free(plan);
+    main_stats.extents = punch.extents;
+
+    byte2str(buf4size, blocks * block_size);
+    snprintf(message, sizeof(message), "Plan: Pages %ld, changed pages skipped %ld\n", header.pages_count, changed);
+    mylog(1, message);
+    snprintf(message, sizeof(message), "Plan: Blocks for trim %ld (%s), extents %ld\n", blocks, buf4size,
+             punch.extents);
+    mylog(1, message);
+    return err;
+}
+
+//Deadline mode: pages of every task are sampled evenly, round by round, so all tasks get samples
+//when the time for sampling is short. Tasks not sampled get the average of sampled ones.
+#define DEADLINE_SAMPLE_PAGES 16
+#define DEADLINE_SAMPLE_SHARE 10 //Sampling takes at most this part of the time left
+struct task_sample {
+    long task;
+    long pages;     //Sampled pages, with free pages and pages in holes
+    long read;      //Sampled pages to read
+    long blocks;    //Free blocks of sampled pages
+};
+
+//Tasks with more free blocks per read page go first, tasks with nothing to read go last
+int task_sample_compare(const void *a, const void *b) {
+    const struct task_sample *sample_a = a;
+    const struct task_sample *sample_b = b;
+    if ((sample_a->read == 0) != (sample_b->read == 0))
+        return sample_a->read == 0 ? 1 : -1;
+    const long yield_a = sample_a->blocks * sample_b->read;
+    const long yield_b = sample_b->blocks * sample_a->read;
+    if (yield_a != yield_b)
+        return yield_a > yield_b ? -1 : 1;
+    return sample_a->task < sample_b->task ? -1 : sample_a->task > sample_b->task;
+}
+
+//Order tasks not done by estimated free blocks per read page, estimated_blocks is their sum
+int deadline_order_tasks(void) {
+    const USHORT page_size = header_page.hdr_page_size;
+    const long sample_finish = monotonic_seconds() + (deadline_time - monotonic_seconds()) / DEADLINE_SAMPLE_SHARE;
+    struct task_sample total = {0, 0, 0, 0};
+    struct task_sample *samples;
+    long samples_count = 0;
+    char *page;
+    char message[128];
+
+    samples = malloc(tasks_count * sizeof(struct task_sample));
+    task_order = malloc(tasks_count * sizeof(long));
+    if (samples == NULL || task_order == NULL || posix_memalign((void **) &page, READ_CHUNK_ALIGN, page_size)) {
+        fprintf(stderr, "Error allocating memory for tasks\n");
+        free(samples);
+        return ERR_MEM;
+    }
+    for (long task = 0; task < tasks_count; task++) {
+        if (task_blocks[task] != TASK_NOT_DONE)
+            continue;
+        samples[samples_count].task = task;
+        samples[samples_count].pages = 0;
+        samples[samples_count].read = 0;
+        samples[samples_count].blocks = 0;
+        samples_count++;
+    }
+    //The first round is done anyway, without it the order is unknown
+    for (int round = 0; round < DEADLINE_SAMPLE_PAGES && (round == 0 || monotonic_seconds() < sample_finish); round++) {
+        for (long sample = 0; sample < samples_count; sample++) {
+            struct task_sample *task_sample = &samples[sample];
+            const long start = task_start(task_sample->task);
+            const long length = task_start(task_sample->task + 1) - start;
+            const long page_num = start + (2 * round + 1) * length / (2 * DEADLINE_SAMPLE_PAGES);
+            const long run = find_free_run(page_num);
+            const long hole = find_hole(page_num);
+            if (length == 0)
+                continue;
+            task_sample->pages++;
+            if ((run < free_runs_count && free_runs[run].start <= page_num) ||
+                (hole < holes_count && holes[hole].start <= page_num))
+                continue;
+            limit_wait(&read_limit, page_size);
+            if (read_full(page, page_size, page_num * page_size)) {
+                fprintf(stderr, "Error read page %ld\n", page_num);
+                free(page);
+                free(samples);
+                return ERR_IO;
+            }
+            const unsigned long page_bitmap = stage2_used_blocks(page, page_size);
+            task_sample->read++;
+            task_sample->blocks += __builtin_popcountl(~page_bitmap & page_bitmap_fill);
+        }
+    }
+    free(page);
+    for (long sample = 0; sample < samples_count; sample++) {
+        total.pages += samples[sample].pages;
+        total.read += samples[sample].read;
+        total.blocks += samples[sample].blocks;
+    }
+    for (long sample = 0; sample < samples_count; sample++) {
+        struct task_sample *task_sample = &samples[sample];
+        const long length = task_start(task_sample->task + 1) - task_start(task_sample->task);
+        if (task_sample->pages == 0 && total.pages > 0) {
+            task_sample->pages = total.pages;
+            task_sample->read = total.read;
+            task_sample->blocks = total.blocks;
+        }
+        if (task_sample->pages > 0)
+            estimated_blocks += task_sample->blocks * length / task_sample->pages;
+    }
+    qsort(samples, samples_count, sizeof(struct task_sample), task_sample_compare);
+    //Done tasks are at the end of order, they are skipped by stage2_next_task()
+    for (long sample = 0; sample < samples_count; sample++) {
+        task_order[sample] = samples[sample].task;
+    }
+    for (long task = 0, index = samples_count; task < tasks_count; task++) {
+        if (task_blocks[task] != TASK_NOT_DONE)
+            task_order[index++] = task;
+    }
+    free(samples);
+    sprintf(message, "Deadline: Sampled pages %ld, read %ld, estimated blocks for trim %ld\n",
+            total.pages, total.read, estimated_blocks);
+    mylog(2, message);
+    return 0;
+}
+
+//Stratified sample: every task is a stratum of its allocated pages not in holes, the pages read by stage 2.
+//Free blocks are summed by page type, so every page type has its own estimate and variance.
+#define SAMPLE_MIN_PAGES 2 //Per stratum, the least count for its variance
+#define SAMPLE_MAX_GROWTH 4 //Sample grows at most in this count of times per round
+#define SAMPLE_Z 1.96 //95% confidence
+struct sample_stratum {
+    long pages;     //Allocated pages not in holes
+    struct page_run *ranges; //Ranges of pages read by stage 2
+    long *ranges_first; //Index of the first page of every range among stratum pages
+    long ranges_count;
+    long sampled;
+    long type_pages[MAX_PAGE_TYPE + 1];
+    double sum[MAX_PAGE_TYPE + 1];
+    double sum_squares[MAX_PAGE_TYPE + 1];
+};
+struct sample_estimate {
+    double pages[MAX_PAGE_TYPE + 1];
+    double blocks[MAX_PAGE_TYPE + 1];
+    double variance[MAX_PAGE_TYPE + 1];
+    double total_blocks;
+    double total_variance;
+};
+unsigned long sample_random_state;
+
+//xorshift64*
+unsigned long sample_random(void) {
+    sample_random_state ^= sample_random_state >> 12;
+    sample_random_state ^= sample_random_state << 25;
+    sample_random_state ^= sample_random_state >> 27;
+    return sample_random_state * 0x2545F4914F6CDD1DUL;
+}
+
+//Ranges of pages read by stage 2 in task and the first index of every range, built once per stratum
+int sample_ranges(struct sample_stratum *stratum, long task) {
+    struct status arg;
+    long allocated = 0;
+
+    arg.start = task_start(task);
+    arg.finish = task_start(task + 1);
+    long run = find_free_run(arg.start);
+    for (long chunk_start = arg.start; chunk_start < arg.finish;) {
+        int range_type;
+        const long chunk_finish = stage2_next_range(&arg, chunk_start, total_pages, &run, &range_type);
+        if (range_type == RANGE_READ && add_page_run(&stratum->ranges, &stratum->ranges_count, &allocated,
+                                                     chunk_start, chunk_finish - chunk_start))
+            return ERR_MEM;
+        chunk_start = chunk_finish;
+    }
+    stratum->ranges_first = malloc((stratum->ranges_count + 1) * sizeof(long));
+    if (stratum->ranges_first == NULL) {
+        fprintf(stderr, "Error allocating memory for sample\n");
+        return ERR_MEM;
+    }
+    for (long range = 0; range < stratum->ranges_count; range++) {
+        stratum->ranges_first[range] = stratum->pages;
+        stratum->pages += stratum->ranges[range].length;
+    }
+    return 0;
+}
+
+//Page number of index-th page of stratum, the range is found by binary search
+long sample_page(const struct sample_stratum *stratum, long index) {
+    long low = 0;
+    long high = stratum->ranges_count - 1;
+
+    while (low < high) {
+        const long middle = (low + high + 1) / 2;
+        if (stratum->ranges_first[middle] <= index)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return stratum->ranges[low].start + index - stratum->ranges_first[low];
+}
+
+//Read count random pages of stratum with replacement. When the whole stratum is needed,
+//the sample is replaced by all its pages, so the estimate is exact.
+int sample_stratum_read(struct sample_stratum *stratum, long count, char *page) {
+    const USHORT page_size = header_page.hdr_page_size;
+    const int whole = stratum->sampled + count >= stratum->pages;
+
+    if (whole) {
+        count = stratum->pages;
+        stratum->sampled = 0;
+        memset(stratum->type_pages, 0, sizeof(stratum->type_pages));
+        memset(stratum->sum, 0, sizeof(stratum->sum));
+        memset(stratum->sum_squares, 0, sizeof(stratum->sum_squares));
+    }
+    for (long sample = 0; sample < count; sample++) {
+        const long index = whole ? sample : (long) (sample_random() % stratum->pages);
+        const long page_num = sample_page(stratum, index);
+        limit_wait(&read_limit, page_size);
+        if (read_full(page, page_size, page_num * page_size)) {
+            fprintf(stderr, "Error read page %ld\n", page_num);
+            return ERR_IO;
+        }
+        const unsigned long page_bitmap = stage2_used_blocks(page, page_size);
+        const int type = page_type_index(((const struct page_header *) page)->page_type);
+        const double blocks = __builtin_popcountl(~page_bitmap & page_bitmap_fill);
+        stratum->type_pages[type]++;
+        stratum->sum[type] += blocks;
+        stratum->sum_squares[type] += blocks * blocks;
+        stratum->sampled++;
+    }
+    return 0;
+}
+
+//Stratified estimate: sum of stratum pages by mean of its sample. Pages are sampled with replacement,
+//so the variance has no finite population correction. Stratum read whole is exact, its variance is 0.
+void sample_estimate(const struct sample_stratum *strata, struct sample_estimate *estimate) {
+    memset(estimate, 0, sizeof(struct sample_estimate));
+    for (long task = 0; task < tasks_count; task++) {
+        const struct sample_stratum *stratum = &strata[task];
+        const double n = (double) stratum->sampled;
+        const double pages = (double) stratum->pages;
+        double sum = 0;
+        double sum_squares = 0;
+        if (stratum->sampled == 0)
+            continue;
+        const double correction = stratum->sampled < stratum->pages ? pages * pages / n : 0;
+        for (int type = 0; type <= MAX_PAGE_TYPE; type++) {
+            estimate->pages[type] += pages * (double) stratum->type_pages[type] / n;
+            estimate->blocks[type] += pages * stratum->sum[type] / n;
+            if (stratum->sampled > 1)
+                estimate->variance[type] += correction *
+                        (stratum->sum_squares[type] - stratum->sum[type] * stratum->sum[type] / n) / (n - 1);
+            sum += stratum->sum[type];
+            sum_squares += stratum->sum_squares[type];
+        }
+        estimate->total_blocks += pages * sum / n;
+        if (stratum->sampled > 1)
+            estimate->total_variance += correction * (sum_squares - sum * sum / n) / (n - 1);
+    }
+}
+
+//Sample mode instead of stage 2: pages of every task are sampled in proportion to its pages.
+//With sample_error the sample grows by rounds until the relative error of 95% interval is reached.
+int sample_stage2(void) {
+    const USHORT page_size = header_page.hdr_page_size;
+    struct sample_stratum *strata;
+    struct sample_estimate estimate;
+    struct timespec now;
+    double percent = sample_percent > 0 ? sample_percent : DEFAULT_SAMPLE_PERCENT;
+    double relative_error = 0;
+    long population = 0;
+    long sampled = 0;
+    char *page;
+    char message[256];
+    char blocks_size[32];
+    char error_size[32];
+    int err = 0;
+
+    init_classify();
+    init_zero_blocks();
+    task_pages = TASK_SIZE / page_size;
+    tasks_count = (total_pages + task_pages - 1) / task_pages;
+    strata = calloc(tasks_count, sizeof(struct sample_stratum));
+    if (strata == NULL || posix_memalign((void **) &page, READ_CHUNK_ALIGN, page_size)) {
+        fprintf(stderr, "Error allocating memory for sample\n");
+        free(strata);
+        return ERR_MEM;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sample_random_state = (unsigned long) now.tv_nsec * 0x9E3779B97F4A7C15UL + (unsigned long) getpid() + 1;
+    for (long task = 0; task < tasks_count && !err; task++) {
+        err = sample_ranges(&strata[task], task);
+        population += strata[task].pages;
+    }
+
+    while (!err) {
+        //Proportional allocation, SAMPLE_MIN_PAGES at least, the whole stratum at most
+        for (long task = 0; task < tasks_count && !err; task++) {
+            struct sample_stratum *stratum = &strata[task];
+            long count = (long) ceil((double) stratum->pages * percent / 100);
+            if (count < SAMPLE_MIN_PAGES)
+                count = SAMPLE_MIN_PAGES;
+            if (count > stratum->pages)
+                count = stratum->pages;
+            if (count > stratum->sampled) {
+                sampled -= stratum->sampled;
+                err = sample_stratum_read(stratum, count - stratum->sampled, page);
+                sampled += stratum->sampled;
+            }
+        }
+        sample_estimate(strata, &estimate);
+        relative_error = estimate.total_blocks > 0 ?
+                         100 * SAMPLE_Z * sqrt(estimate.total_variance) / estimate.total_blocks : 0;
+        if (sample_error == 0 || relative_error <= sample_error || percent >= 100 || estimate.total_blocks == 0)
+            break;
+        //Sample size for the target error, error is inversely proportional to square root of size
+        const double needed = percent * (relative_error / sample_error) * (relative_error / sample_error);
+        percent = needed < percent * SAMPLE_MAX_GROWTH ? needed : percent * SAMPLE_MAX_GROWTH;
+        if (percent > 100)
+            percent = 100;
+        if (log_level >= 2) {
+            sprintf(message, "Sample: Relative error %.1f%%, grow sample to %.2f%%\n", relative_error, percent);
+            mylog(2, message);
+        }
+    }
+    free(page);
+    for (long task = 0; task < tasks_count; task++) {
+        free(strata[task].ranges);
+        free(strata[task].ranges_first);
+    }
+    free(strata);
+    if (err)
+        return err;
+
+    sprintf(message, "Sample: Pages read %ld of %ld (%.2f%%), strata %ld\n", sampled, population,
+            population ? 100.0 * (double) sampled / (double) population : 0, tasks_count);
+    mylog(1, message);
+    for (int type = 0; type <= MAX_PAGE_TYPE; type++) {
+        if (estimate.pages[type] < 0.5)
+            continue;
+        const double error = SAMPLE_Z * sqrt(estimate.variance[type]);
+        byte2str(blocks_size, (long) (estimate.blocks[type] * block_size));
+        byte2str(error_size, (long) (error * block_size));
+        sprintf(message, "Sample: %s: pages %.0f, blocks for trim %.0f +- %.0f (%s +- %s)\n",
+                page_type_name[type], estimate.pages[type], estimate.blocks[type], error, blocks_size, error_size);
+        mylog(1, message);
+    }
+    byte2str(blocks_size, (long) (estimate.total_blocks * block_size));
+    byte2str(error_size, (long) (SAMPLE_Z * sqrt(estimate.total_variance) * block_size));
+    sprintf(message, "Sample: Stage 2 blocks for trim %.0f +- %.0f (%s +- %s, %.1f%%) at 95%% confidence\n",
+            estimate.total_blocks, SAMPLE_Z * sqrt(estimate.total_variance), blocks_size, error_size, relative_error);
+    mylog(1, message);
+    byte2str(blocks_size, (pages_for_trim - free_pages_in_holes) * page_size + (long) (estimate.total_blocks * block_size));
+    sprintf(message, "Sample: Stage 1 and stage 2 for trim %s +- %s\n", blocks_size, error_size);
+    mylog(1, message);
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+//Queue reads of chunk into slot: one read of all pages or, with probe, first block of every page
+int stage2_uring_queue(struct uring *ring, int slot, char *buffer, long chunk_start, long chunk_finish) {
+    const USHORT page_size = header_page.hdr_page_size;
+    struct io_uring_sqe *sqe;
+
+    ring->slot_pending[slot] = 0;
+    ring->slot_result[slot] = 0;
+    limit_wait(&read_limit, (chunk_finish - chunk_start) * (probe_pages ? block_size : page_size));
+    for (long page_num = chunk_start; page_num < chunk_finish; page_num++) {
+        if ((sqe = uring_next_sqe(ring)) == NULL)
+            return ERR_IO;
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fd_read;
+        sqe->off = page_num * page_size;
+        sqe->addr = (unsigned long) (buffer + (page_num - chunk_start) * page_size);
+        sqe->len = probe_pages ? block_size : (chunk_finish - chunk_start) * page_size;
+        sqe->buf_index = slot;
+        sqe->user_data = slot;
+        ring->slot_pending[slot]++;
+        if (!probe_pages)
+            break;
+    }
+    return 0;
+}
+
+//Registered buffers of io_uring for stage 2 thread, returns -1 when io_uring can't be used
+int stage2_uring_setup(struct uring *ring, char **buffers, struct iovec *iov) {
+    const USHORT page_size = header_page.hdr_page_size;
+    const long chunk_pages = read_chunk_size / page_size > 0 ? read_chunk_size / page_size : 1;
+
+    if (uring_init(ring, URING_ENTRIES))
+        return -1;
+    if (posix_memalign((void **) buffers, READ_CHUNK_ALIGN, io_uring_depth * chunk_pages * page_size)) {
+        uring_free(ring);
+        return -1;
+    }
+    for (int slot = 0; slot < io_uring_depth; slot++) {
+        iov[slot].iov_base = *buffers + slot * chunk_pages * page_size;
+        iov[slot].iov_len = chunk_pages * page_size;
+    }
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, io_uring_depth)) {
+        free(*buffers);
+        uring_free(ring);
+        return -1;
+    }
+    return 0;
+}
+
+void stage2_uring_free(struct uring *ring, char *buffers) {
+    //Requests still in flight use registered buffers
+    while (ring->in_flight > 0) {
+        if (uring_submit(ring, 1))
+            break;
+        uring_reap(ring);
+    }
+    uring_free(ring);
+    free(buffers);
+}
+
+//Stage 2 on io_uring, pages [arg->position, arg->finish): io_uring_depth chunk reads in flight,
+//fallocate queued to the same ring
+int stage2_uring_range(struct status *arg, struct uring *ring, struct iovec *iov,
+                       struct stage2_punch *punch, long *blocks_for_trim_thr) {
+    struct stage2_stats *stats = &stage2_stats[arg->thread_number];
+    const USHORT page_size = header_page.hdr_page_size;
+    const long chunk_pages = read_chunk_size / page_size > 0 ? read_chunk_size / page_size : 1;
+    const int depth = io_uring_depth;
+    long slot_start[MAX_IO_URING_DEPTH];
+    long slot_finish[MAX_IO_URING_DEPTH];
+    long slot_free_finish[MAX_IO_URING_DEPTH]; //End of free run after chunk
+    struct timespec slot_queued[MAX_IO_URING_DEPTH]; //Read latency is counted till its completion is seen
+    int err = 0;
+
+    long run = find_free_run(arg->position);
+    long next_start = arg->position;
+    int head = 0;
+    int queued = 0;
+    while (1) {
+        //Queue reads of next chunks, free runs and holes between them are skipped
+        while (queued < depth && next_start < arg->finish) {
+            int range_type;
+            const long chunk_finish = stage2_next_range(arg, next_start, chunk_pages, &run, &range_type);
+            if (range_type != RANGE_READ)
+                stage2_count(&stats->pages_done, chunk_finish - next_start);
+            if (range_type == RANGE_HOLE) {
+                stage2_count(&stats->pages_hole, chunk_finish - next_start);
+            } else if (range_type == RANGE_FREE && !stage1_trim_deferred) {
+                //Free run is trimmed on stage 1 already
+            } else if (range_type == RANGE_FREE && queued == 0) {
+                if (stage2_punch_add(punch, next_start * page_size, (chunk_finish - next_start) * page_size)) {
+                    err = ERR_TRIM;
+                    break;
+                }
+            } else if (range_type == RANGE_FREE) {
+                //Free run is trimmed after the chunk queued before it, to join with its free tail.
+                //Holes between them are skipped by stage2_punch_add().
+                slot_free_finish[(head + queued - 1) % depth] = chunk_finish;
+            } else {
+                const int slot = (head + queued) % depth;
+                slot_start[slot] = next_start;
+                slot_finish[slot] = chunk_finish;
+                slot_free_finish[slot] = chunk_finish;
+                clock_gettime(CLOCK_MONOTONIC, &slot_queued[slot]);
+                if ((err = stage2_uring_queue(ring, slot, iov[slot].iov_base, next_start, chunk_finish)))
+                    break;
+                queued++;
+            }
+            next_start = chunk_finish;
+            if (queued == 0)
+                arg->position = next_start;
+        }
+        if (err || queued == 0)
+            break;
+        //Chunks are processed in file order
+        if (uring_submit(ring, ring->slot_pending[head] ? 1 : 0)) {
+            err = ERR_IO;
+            break;
+        }
+        if (uring_reap(ring)) {
+            fprintf(stderr, "fallocate failed\n");
+            err = ERR_TRIM;
+            break;
+        }
+        while (queued > 0 && ring->slot_pending[head] == 0) {
+            const long chunk_start = slot_start[head];
+            const long chunk_finish = slot_finish[head];
+            const long chunk_bytes = (chunk_finish - chunk_start) * page_size;
+            char *chunk = iov[head].iov_base;
+            const long result = ring->slot_result[head];
+            latency_add(&stats->read_latency, &slot_queued[head]);
+            if (result < 0 ||
+                (!probe_pages && result < chunk_bytes &&
+                 read_full(chunk + result, chunk_bytes - result, chunk_start * page_size + result))) {
+                fprintf(stderr, "Error read pages %ld - %ld\n", chunk_start, chunk_finish - 1);
+                err = ERR_IO;
+                break;
+            }
+            const long blocks_before = *blocks_for_trim_thr;
+            long bytes_read = probe_pages ? (chunk_finish - chunk_start) * block_size : chunk_bytes;
+            for (long page_num = chunk_start; page_num < chunk_finish; page_num++) {
+                char *page = chunk + (page_num - chunk_start) * page_size;
+                long probed = page_size;
+                if (task_scn && stage2_page_unchanged(arg, page))
+                    continue;
+                if (probe_pages && (probed = stage2_probe_extend(page, page_num)) < 0) {
+                    fprintf(stderr, "Error read page %ld\n", page_num);
+                    err = ERR_IO;
+                    break;
+                }
+                if (probed > block_size && probed < page_size)
+                    bytes_read += probed - block_size;
+                if ((err = stage2_page(punch, page, page_num, probed, blocks_for_trim_thr)))
+                    break;
+            }
+            if (!err && slot_free_finish[head] > chunk_finish &&
+                stage2_punch_add(punch, chunk_finish * page_size, (slot_free_finish[head] - chunk_finish) * page_size))
+                err = ERR_TRIM;
+            if (err)
+                break;
+            drop_chunk(chunk_start, chunk_finish);
+            stage2_count(&stats->pages_done, chunk_finish - chunk_start);
+            stage2_count(&stats->pages_read, chunk_finish - chunk_start);
+            stage2_count(&stats->bytes_read, bytes_read);
+            stage2_count(&stats->blocks, *blocks_for_trim_thr - blocks_before);
+            //Ranges before the next queued chunk are done
+            arg->position = queued > 1 ? slot_start[(head + 1) % depth] : next_start;
+            head = (head + 1) % depth;
+            queued--;
+        }
+        if (err)
+            break;
+    }
+    return err;
+}
+#endif
+
+//Stage 2 on pread, pages [arg->position, arg->finish)
+int stage2_pread_range(struct status *arg, char *chunk, struct stage2_punch *punch, long *blocks_for_trim_thr) {
+    struct stage2_stats *stats = &stage2_stats[arg->thread_number];
+    const USHORT page_size = header_page.hdr_page_size;
+    const long chunk_pages = read_chunk_size / page_size > 0 ? read_chunk_size / page_size : 1;
+    //Probe takes a call per page, when the first block is a large part of page one read of chunk is cheaper
+    const short probe_chunk = probe_pages && page_size / block_size >= PROBE_PREAD_MIN_BLOCKS;
+    int err;
+
+    long run = find_free_run(arg->position);
+    long chunk_start = arg->position;
+    while (chunk_start < arg->finish) {
+        int range_type;
+        const long chunk_finish = stage2_next_range(arg, chunk_start, chunk_pages, &run, &range_type);
+        if (range_type == RANGE_HOLE) {
+            stage2_count(&stats->pages_hole, chunk_finish - chunk_start);
+        } else if (range_type == RANGE_FREE) {
+            //Free run is joined with free blocks of pages, or it is trimmed on stage 1 already
+            if (stage1_trim_deferred &&
+                stage2_punch_add(punch, chunk_start * page_size, (chunk_finish - chunk_start) * page_size))
+                return ERR_TRIM;
+        } else {
+            const long blocks_before = *blocks_for_trim_thr;
+            long bytes_read = (chunk_finish - chunk_start) * (probe_chunk ? block_size : page_size);
+            struct timespec read_started;
+            limit_wait(&read_limit, bytes_read);
+            clock_gettime(CLOCK_MONOTONIC, &read_started);
+            if (probe_chunk)
+                err = stage2_probe_chunk(chunk, chunk_start, chunk_finish);
+            else
+                err = read_full(chunk, (chunk_finish - chunk_start) * page_size, chunk_start * page_size);
+            latency_add(&stats->read_latency, &read_started);
+            if (err) {
+                fprintf(stderr, "Error read pages %ld - %ld\n", chunk_start, chunk_finish - 1);
+                return ERR_IO;
+            }
+            for (long page_num = chunk_start; page_num < chunk_finish; page_num++) {
+                char *page = chunk + (page_num - chunk_start) * page_size;
+                long probed = page_size;
+                if (task_scn && stage2_page_unchanged(arg, page))
+                    continue;
+                if (probe_chunk && (probed = stage2_probe_extend(page, page_num)) < 0) {
+                    fprintf(stderr, "Error read page %ld\n", page_num);
+                    return ERR_IO;
+                }
+                if (probed > block_size && probed < page_size)
+                    bytes_read += probed - block_size;
+                if ((err = stage2_page(punch, page, page_num, probed, blocks_for_trim_thr)))
+                    return err;
+            }
+            stage2_count(&stats->pages_read, chunk_finish - chunk_start);
+            stage2_count(&stats->bytes_read, bytes_read);
+            stage2_count(&stats->blocks, *blocks_for_trim_thr - blocks_before);
+            drop_chunk(chunk_start, chunk_finish);
+        }
+        stage2_count(&stats->pages_done, chunk_finish - chunk_start);
+        chunk_start = chunk_finish;
+        arg->position = chunk_start;
+    }
+    return 0;
+}
+
+//Stage 2 thread: takes tasks from the shared cursor until all of them are taken
+void * stage2(void *argv) {
+    struct status *arg = argv;
+    struct stage2_stats *stats = &stage2_stats[arg->thread_number];
+    char *chunk = NULL;
+    const USHORT page_size = header_page.hdr_page_size;
+    const long chunk_pages = read_chunk_size / page_size > 0 ? read_chunk_size / page_size : 1;
+    char message[128];
+    struct stage2_punch punch = {NULL, NULL, NULL, stats, 0, 0, 0};
+    int err = 0;
+    long task;
+
+    if (log_level >= 2) {
+        sprintf(message, "Started thread %d\n", arg->thread_number);
+        mylog(2, message);
+    }
+    if (log_level >= 3)
+        punch.log = log_ring_get(arg->thread_number + 1);
+    if (plan_save_filename)
+        punch.plan = &plan_thread[arg->thread_number];
+    if (io_idle && set_io_idle()) {
+        arg->error = ERR_IO;
+        return 0;
+    }
+
+#ifdef HAVE_IO_URING
+    struct uring ring;
+    char *buffers = NULL;
+    struct iovec iov[MAX_IO_URING_DEPTH];
+    if (use_io_uring) {
+        if (stage2_uring_setup(&ring, &buffers, iov) == 0) {
+            punch.ring = &ring;
+        } else if (log_level >= 2) {
+            sprintf(message, "Thread %d can't use io_uring, use pread\n", arg->thread_number);
+            mylog(2, message);
+        }
+    }
+#endif
+
+    if (punch.ring == NULL && posix_memalign((void **) &chunk, READ_CHUNK_ALIGN, chunk_pages * page_size)) {
+        fprintf(stderr, "Error allocating read buffer in thread %d\n", arg->thread_number);
+        arg->error = ERR_MEM;
+        return 0;
+    }
+    while ((task = stage2_next_task()) >= 0) {
+        long task_blocks_thr = 0;
+        struct timespec task_started;
+        clock_gettime(CLOCK_MONOTONIC, &task_started);
+        arg->start = task_start(task);
+        arg->finish = task_start(task + 1);
+        arg->position = arg->start;
+        arg->max_scn = 0;
+        if (log_level >= 2) {
+            sprintf(message, "Thread %d task %ld range %ld - %ld\n", arg->thread_number, task, arg->start, arg->finish);
+            mylog(2, message);
+        }
+#ifdef HAVE_IO_URING
+        if (punch.ring) {
+            err = stage2_uring_range(arg, &ring, iov, &punch, &task_blocks_thr);
+            //Task is done when all its fallocate calls are completed
+            if (!err && (stage2_punch_flush(&punch) || uring_drain(&ring))) {
+                fprintf(stderr, "fallocate failed\n");
+                err = ERR_TRIM;
+            }
+        } else
+#endif
+        {
+            err = stage2_pread_range(arg, chunk, &punch, &task_blocks_thr);
+            if (!err)
+                err = stage2_punch_flush(&punch);
+        }
+        if (err)
+            break;
+        arg->blocks_for_trim += task_blocks_thr;
+        if (task_scn)
+            task_scn[task] = arg->max_scn;
+        stats->busy_seconds += seconds_since(&task_started);
+        if ((err = stage2_task_done(arg, task, task_blocks_thr)))
+            break;
+    }
+#ifdef HAVE_IO_URING
+    if (punch.ring)
+        stage2_uring_free(&ring, buffers);
+#endif
+    free(chunk);
+    stage2_count(&stats->extents, punch.extents);
+    arg->error = err;
+    return 0;
+}
+
+//Stage 2 failed with deferred trim of stage 1: free pages of tasks not done are trimmed as stage 1 would do
+int stage2_trim_rest(void) {
+    const USHORT page_size = header_page.hdr_page_size;
+    struct stage2_punch punch = {NULL, log_level >= 3 ? log_ring_get(0) : NULL, NULL, &main_stats, 0, 0, 0};
+    int err = 0;
+
+    for (long task = 0; task < tasks_count && !err; task++) {
+        if (task_blocks[task] != TASK_NOT_DONE)
+            continue;
+        const long finish = task_start(task + 1);
+        for (long run = find_free_run(task_start(task)); run < free_runs_count && free_runs[run].start < finish; run++) {
+            if ((err = stage2_punch_add(&punch, free_runs[run].start * page_size, free_runs[run].length * page_size)))
+                break;
+        }
+    }
+    if (!err)
+        err = stage2_punch_flush(&punch);
+    main_stats.extents += punch.extents;
+    return err;
+}
+
+//Ranges kept by punch policy and FIEMAP extents of file before and after trim
+void policy_report(void) {
+    char message[160];
+    char buf4size[32];
+    long kept_extents = main_stats.policy_extents;
+    long kept_bytes = main_stats.policy_bytes;
+
+    for (int thread = 0; thread < stage2_threads; thread++) {
+        kept_extents += stage2_stats[thread].policy_extents;
+        kept_bytes += stage2_stats[thread].policy_bytes;
+    }
+    if (min_hole_size || punch_align || max_extents_per_gib) {
+        byte2str(buf4size, kept_bytes);
+        sprintf(message, "Policy: Kept ranges %ld, kept %s with unaligned parts of trimmed ranges\n",
+                kept_extents, buf4size);
+        mylog(1, message);
+    }
+    if (trim && file_extents_before >= 0) {
+        sprintf(message, "File extents before %ld, after %ld\n", file_extents_before, file_extents_after);
+        mylog(1, message);
+    }
+}
+
+//Sums of all threads for metrics
+struct metrics {
+    struct stage2_stats total;
+    long fallocate_calls;
+    double total_seconds;
+};
+
+void metrics_collect(struct metrics *metrics) {
+    struct stage2_stats *total = &metrics->total;
+
+    memset(metrics, 0, sizeof(struct metrics));
+    for (int thread = -1; thread < stage2_threads; thread++) {
+        const struct stage2_stats *stats = thread < 0 ? &main_stats : &stage2_stats[thread];
+        total->pages_read += stats->pages_read;
+        total->pages_hole += stats->pages_hole;
+        total->pages_unchanged += stats->pages_unchanged;
+        total->bytes_read += stats->bytes_read;
+        total->extents += stats->extents;
+        for (int type = 0; type <= MAX_PAGE_TYPE; type++) {
+            total->page_type_blocks[type] += stats->page_type_blocks[type];
+        }
+        total->trimmed_bytes += stats->trimmed_bytes;
+        total->policy_extents += stats->policy_extents;
+        total->policy_bytes += stats->policy_bytes;
+        latency_merge(&total->read_latency, &stats->read_latency);
+        latency_merge(&total->fallocate_latency, &stats->fallocate_latency);
+    }
+    //Free runs of stage 1 are trimmed by stage 2 threads when they are deferred
+    if (!stage1_trim_deferred)
+        total->extents += extents_for_trim;
+    metrics->fallocate_calls = trim ? total->extents : 0;
+    metrics->total_seconds = seconds_since(&run_started);
+}
+
+void json_string(FILE *file, const char *string) {
+    fputc('"', file);
+    for (; *string; string++) {
+        if (*string == '"' || *string == '\\')
+            fprintf(file, "\\%c", *string);
+        else if ((UCHAR) *string < 0x20)
+            fprintf(file, "\\u%04x", *string);
+        else
+            fputc(*string, file);
+    }
+    fputc('"', file);
+}
+
+void json_latency(FILE *file, const char *name, const struct latency_histogram *histogram) {
+    fprintf(file, "  \"%s\": {\"calls\": %ld, \"seconds\": %.6f, \"buckets_us\": {", name,
+            histogram->calls, histogram->seconds);
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        if (bucket < LATENCY_BUCKETS - 1)
+            fprintf(file, "\"%lu\": %ld, ", 1UL << bucket, histogram->count[bucket]);
+        else
+            fprintf(file, "\"+Inf\": %ld", histogram->count[bucket]);
+    }
+    fprintf(file, "}}");
+}
+
+void metrics_json(FILE *file, const struct metrics *metrics, int err) {
+    const struct stage2_stats *total = &metrics->total;
+    const USHORT page_size = header_page.hdr_page_size;
+
+    fprintf(file, "{\n  \"database\": ");
+    json_string(file, db_filename);
+    fprintf(file, ",\n  \"version\": \"" pluck_VERSION "\",\n"
+                  "  \"page_size\": %d,\n  \"block_size\": %d,\n  \"trim\": %s,\n  \"stage\": %d,\n"
+                  "  \"threads\": %d,\n  \"error\": %d,\n",
+            page_size, block_size, trim ? "true" : "false", stage, stage2_threads, err);
+    fprintf(file, "  \"seconds\": {\"total\": %.3f, \"stage1\": %.3f, \"stage2\": %.3f},\n",
+            metrics->total_seconds, stage1_seconds, stage2_seconds);
+    fprintf(file, "  \"pages\": {\"total\": %ld, \"free\": %ld, \"free_in_holes\": %ld, \"in_holes\": %ld, "
+                  "\"allocated_in_holes\": %ld, \"read\": %ld, \"unchanged\": %ld},\n",
+            total_pages, pages_for_trim, free_pages_in_holes, hole_pages, total->pages_hole, total->pages_read,
+            total->pages_unchanged);
+    fprintf(file, "  \"bytes_read\": %ld,\n  \"extents\": %ld,\n  \"fallocate_calls\": %ld,\n",
+            total->bytes_read, total->extents, metrics->fallocate_calls);
+    fprintf(file, "  \"policy\": {\"kept_extents\": %ld, \"kept_bytes\": %ld},\n",
+            total->policy_extents, total->policy_bytes);
+    fprintf(file, "  \"file_extents\": {\"before\": %ld, \"after\": %ld},\n", file_extents_before,
+            trim ? file_extents_after : file_extents_before);
+    fprintf(file, "  \"trimmed_bytes\": %ld,\n", total->trimmed_bytes);
+    fprintf(file, "  \"candidate_bytes\": {\"free page\": %ld", stage1_pages_trimmed * page_size);
+    for (int type = 0; type <= MAX_PAGE_TYPE; type++) {
+        fprintf(file, ", \"%s\": %ld", page_type_name[type], total->page_type_blocks[type] * block_size);
+    }
+    fprintf(file, "},\n  \"thread_seconds\": [");
+    for (int thread = 0; thread < stage2_threads; thread++) {
+        const double busy = stage2_stats[thread].busy_seconds;
+        fprintf(file, "%s{\"busy\": %.3f, \"idle\": %.3f}", thread ? ", " : "",
+                busy, stage2_seconds > busy ? stage2_seconds - busy : 0);
+    }
+    fprintf(file, "],\n");
+    if (objects_enabled) {
+        fprintf(file, "  \"objects\": [");
+        for (long object_index = 0; object_index < objects_total.count; object_index++) {
+            const struct object_stats *object = &objects_total.slots[object_index];
+            fprintf(file, "%s\n    {\"relation\": %u, ", object_index ? "," : "", object->key >> 16);
+            if (object->key & OBJECT_INDEX)
+                fprintf(file, "\"index\": %u, ", (object->key & 0xff) + 1);
+            fprintf(file, "\"pages\": %ld, \"used_bytes\": %ld, \"unused_bytes\": %ld, \"candidate_bytes\": %ld, \"fill\": [",
+                    object->pages, object->used_bytes, object->pages * page_size - object->used_bytes,
+                    object->free_blocks * block_size);
+            for (int bucket = 0; bucket < OBJECT_FILL_BUCKETS; bucket++) {
+                fprintf(file, "%s%ld", bucket ? ", " : "", object->fill[bucket]);
+            }
+            fprintf(file, "]}");
+        }
+        fprintf(file, "\n  ],\n");
+    }
+    json_latency(file, "read_latency", &total->read_latency);
+    fprintf(file, ",\n");
+    json_latency(file, "fallocate_latency", &total->fallocate_latency);
+    fprintf(file, "\n}\n");
+}
+
+//Metric line with database label, labels are added after it
+void prom_metric(FILE *file, const char *name, const char *database, const char *labels, double value) {
+    fprintf(file, "%s{database=\"%s\"%s} %.15g\n", name, database, labels, value);
+}
+
+void prom_header(FILE *file, const char *name, const char *type, const char *help) {
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void prom_latency(FILE *file, const char *name, const char *database, const struct latency_histogram *histogram) {
+    char metric[64];
+    char labels[64];
+    long count = 0;
+
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        count += histogram->count[bucket];
+        if (bucket < LATENCY_BUCKETS - 1)
+            sprintf(labels, ",le=\"%g\"", (double) (1UL << bucket) / 1e6);
+        else
+            sprintf(labels, ",le=\"+Inf\"");
+        sprintf(metric, "%s_bucket", name);
+        prom_metric(file, metric, database, labels, (double) count);
+    }
+    sprintf(metric, "%s_sum", name);
+    prom_metric(file, metric, database, "", histogram->seconds);
+    sprintf(metric, "%s_count", name);
+    prom_metric(file, metric, database, "", (double) histogram->calls);
+}
+
+void metrics_prom(FILE *file, const struct metrics *metrics, int err) {
+    const struct stage2_stats *total = &metrics->total;
+    const USHORT page_size = header_page.hdr_page_size;
+    char database[2 * strlen(db_filename) + 1];
+    char labels[64];
+    char *label = database;
+
+    for (const char *name = db_filename; *name; name++) {
+        if (*name == '"' || *name == '\\' || *name == '\n')
+            *label++ = '\\';
+        *label++ = *name == '\n' ? 'n' : *name;
+    }
+    *label = 0;
+
+    prom_header(file, "pluck_seconds", "gauge", "Wall time of run and its stages");
+    prom_metric(file, "pluck_seconds", database, ",stage=\"total\"", metrics->total_seconds);
+    prom_metric(file, "pluck_seconds", database, ",stage=\"1\"", stage1_seconds);
+    prom_metric(file, "pluck_seconds", database, ",stage=\"2\"", stage2_seconds);
+    prom_header(file, "pluck_pages", "gauge", "Pages of database file");
+    prom_metric(file, "pluck_pages", database, ",kind=\"total\"", (double) total_pages);
+    prom_metric(file, "pluck_pages", database, ",kind=\"free\"", (double) pages_for_trim);
+    prom_metric(file, "pluck_pages", database, ",kind=\"free_in_holes\"", (double) free_pages_in_holes);
+    prom_metric(file, "pluck_pages", database, ",kind=\"in_holes\"", (double) hole_pages);
+    prom_metric(file, "pluck_pages", database, ",kind=\"allocated_in_holes\"", (double) total->pages_hole);
+    prom_metric(file, "pluck_pages", database, ",kind=\"read\"", (double) total->pages_read);
+    prom_metric(file, "pluck_pages", database, ",kind=\"unchanged\"", (double) total->pages_unchanged);
+    prom_header(file, "pluck_read_bytes", "gauge", "Bytes read on stage 2");
+    prom_metric(file, "pluck_read_bytes", database, "", (double) total->bytes_read);
+    prom_header(file, "pluck_extents", "gauge", "Extents for trim");
+    prom_metric(file, "pluck_extents", database, "", (double) total->extents);
+    prom_header(file, "pluck_fallocate_calls", "gauge", "Calls of fallocate");
+    prom_metric(file, "pluck_fallocate_calls", database, "", (double) metrics->fallocate_calls);
+    prom_header(file, "pluck_policy_kept_extents", "gauge", "Ranges not trimmed by punch policy");
+    prom_metric(file, "pluck_policy_kept_extents", database, "", (double) total->policy_extents);
+    prom_header(file, "pluck_policy_kept_bytes", "gauge", "Bytes not trimmed by punch policy");
+    prom_metric(file, "pluck_policy_kept_bytes", database, "", (double) total->policy_bytes);
+    prom_header(file, "pluck_file_extents", "gauge", "FIEMAP extents of database file before and after run");
+    prom_metric(file, "pluck_file_extents", database, ",when=\"before\"", (double) file_extents_before);
+    prom_metric(file, "pluck_file_extents", database, ",when=\"after\"",
+                (double) (trim ? file_extents_after : file_extents_before));
+    prom_header(file, "pluck_trimmed_bytes", "gauge", "Bytes passed to fallocate, 0 in dry run");
+    prom_metric(file, "pluck_trimmed_bytes", database, "", (double) total->trimmed_bytes);
+    prom_header(file, "pluck_candidate_bytes", "gauge",
+                "Bytes found for trim by page type before punch policy, free pages of stage 1 are free page");
+    prom_metric(file, "pluck_candidate_bytes", database, ",page_type=\"free page\"",
+                (double) (stage1_pages_trimmed * page_size));
+    for (int type = 0; type <= MAX_PAGE_TYPE; type++) {
+        snprintf(labels, sizeof(labels), ",page_type=\"%s\"", page_type_name[type]);
+        prom_metric(file, "pluck_candidate_bytes", database, labels, (double) (total->page_type_blocks[type] * block_size));
+    }
+    prom_header(file, "pluck_thread_busy_seconds", "gauge", "Time of stage 2 thread in tasks");
+    for (int thread = 0; thread < stage2_threads; thread++) {
+        sprintf(labels, ",thread=\"%d\"", thread);
+        prom_metric(file, "pluck_thread_busy_seconds", database, labels, stage2_stats[thread].busy_seconds);
+    }
+    prom_header(file, "pluck_thread_idle_seconds", "gauge", "Time of stage 2 without tasks of thread");
+    for (int thread = 0; thread < stage2_threads; thread++) {
+        const double busy = stage2_stats[thread].busy_seconds;
+        sprintf(labels, ",thread=\"%d\"", thread);
+        prom_metric(file, "pluck_thread_idle_seconds", database, labels, stage2_seconds > busy ? stage2_seconds - busy : 0);
+    }
+    prom_header(file, "pluck_read_latency_seconds", "histogram", "Latency of chunk reads on stage 2");
+    prom_latency(file, "pluck_read_latency_seconds", database, &total->read_latency);
+    prom_header(file, "pluck_fallocate_latency_seconds", "histogram", "Latency of synchronous fallocate calls");
+    prom_latency(file, "pluck_fallocate_latency_seconds", database, &total->fallocate_latency);
+    prom_header(file, "pluck_trim", "gauge", "1 for trim, 0 for dry run");
+    prom_metric(file, "pluck_trim", database, "", trim);
+    prom_header(file, "pluck_error", "gauge", "Exit code of run");
+    prom_metric(file, "pluck_error", database, "", err);
+    prom_header(file, "pluck_last_run_timestamp_seconds", "gauge", "Time of the end of run");
+    prom_metric(file, "pluck_last_run_timestamp_seconds", database, "", (double) time(NULL));
+}
+
+//Metrics are written by temporary file and rename, so readers never see a part of them
+int metrics_write(int err) {
+    struct metrics metrics;
+    int status = 0;
+
+    if (!metrics_filename && !metrics_prom_filename)
+        return 0;
+    metrics_collect(&metrics);
+    for (int format = 0; format < 2; format++) {
+        const char *filename = format == 0 ? metrics_filename : metrics_prom_filename;
+        char *data = NULL;
+        size_t size = 0;
+        if (!filename)
+            continue;
+        FILE *file = open_memstream(&data, &size);
+        if (file == NULL) {
+            fprintf(stderr, "Error allocating memory for metrics\n");
+            return ERR_MEM;
+        }
+        if (format == 0)
+            metrics_json(file, &metrics, err);
+        else
+            metrics_prom(file, &metrics, err);
+        fclose(file);
+        if (write_file_atomic(filename, data, (long) size))
+            status = ERR_IO;
+        free(data);
+    }
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    struct stat fstat_before, fstat_after;
+    int status;
+    char message[128];
+    int err = 0;
+    char buf4size[32];
+    struct timespec stage2_started, stage2_finished;
+    long bytes_read = 0;
+    long extents = 0;
+    long pages_hole = 0;
+    long pages_unchanged = 0;
+    long tasks_changed = 0;
+    long blocks_trimmed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &run_started);
+    parse(argc, argv);
+    if (goodbye > 0)
+        return goodbye - 1;
+    deadline_time = monotonic_seconds() + deadline;
+    //todo: Change info from different debug levels
+    //todo: Change format, max page count
+    if (status_filename && (db_filename == NULL)) {
+        struct status_file_header status_header;
+        long *status_tasks;
+        fd_status_file = open(status_filename, O_RDONLY);
+        if (fd_status_file < 0) {
+            fprintf(stderr, "Error %d open file %s\n", fd_status_file, status_filename);
+            return ERR_IO;
+        }
+        if ((err = status_file_read(fd_status_file, &status_header, &status_tasks)))
+            return err;
+        fprintf(stdout, "Version %d, checkpoint %ld, threads %d, pages %ld, pages per task %ld, tasks %ld\n"
+                        "Page size %d, block size %d, %s\n",
+                status_header.version, status_header.sequence, status_header.threads_count,
+                status_header.total_pages, status_header.task_pages, status_header.tasks_count,
+                status_header.page_size, status_header.block_size, status_header.trim ? "trim" : "dry run");
+        fprintf(stdout, "task\tstart\tfinish\ttrim\n"
+                        "\tpage\tpage\tblock\n");
+        long done = 0;
+        const long *status_starts = status_tasks + status_header.tasks_count;
+        for (long task = 0; task < status_header.tasks_count; task++) {
+            if (status_tasks[task] != TASK_NOT_DONE) {
+                fprintf(stdout, "%ld\t%ld\t%ld\t%ld\n", task, status_starts[task],
+                        task + 1 < status_header.tasks_count ? status_starts[task + 1] : status_header.total_pages,
+                        status_tasks[task]);
+                done++;
+            }
+        }
+        fprintf(stdout, "Done tasks %ld / %ld\n", done, status_header.tasks_count);
+        free(status_tasks);
+        close(fd_status_file);
+        return 0;
+    }
+    if (!db_filename) {
+        help(argv[0]);
+        return 0;
+    }
+    if (incremental && !manifest_filename) {
+        fprintf(stderr, "Incremental mode needs manifest file\n");
+        return 1;
+    }
+    if (plan_save_filename && (trim || status_filename || plan_apply_filename || stage != 2)) {
+        fprintf(stderr, "Plan is saved only by dry run of stage 2 without status file\n");
+        return 1;
+    }
+    if (objects_enabled && (trim || status_filename || plan_apply_filename || deadline || incremental || stage != 2 ||
+                            sample_percent > 0 || sample_error > 0)) {
+        fprintf(stderr, "Objects are reported only by full dry run of stage 2 without status file\n");
+        return 1;
+    }
+    //Plan is trimmed by blocks of its own size, it replaces -b
+    const int punch_block_size = plan_apply_filename && punch_align ? plan_block_size() : block_size;
+    if (punch_align && punch_block_size <= 0) {
+        fprintf(stderr, "Error read plan %s\n", plan_apply_filename);
+        return ERR_IO;
+    }
+    if (punch_align % punch_block_size) {
+        fprintf(stderr, "Alignment must be multiple of block size %d\n", punch_block_size);
+        return 1;
+    }
+    if (deadline && (plan_save_filename || plan_apply_filename)) {
+        fprintf(stderr, "Deadline and plan are incompatible\n");
+        return 1;
+    }
+    if ((sample_percent > 0 || sample_error > 0) &&
+        (trim || status_filename || plan_save_filename || plan_apply_filename || deadline)) {
+        fprintf(stderr, "Sample is estimated only by dry run without status file, plan and deadline\n");
+        return 1;
+    }
+
+    if (!trim) {
+        mylog(1, "Dry run mode\n");
+    }
+
+    if (trim) {
+        fd = open(db_filename, O_RDWR);
+    } else {
+        fd = open(db_filename, O_RDONLY);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error %d open file %s\n", fd, db_filename);
+        return ERR_IO;
+    }
+    fd_read = fd;
+
+    //read page_size & ods_version
+    if (pread(fd, &header_page, sizeof(header_page), 0) != sizeof(header_page))
+    {
+        fprintf(stderr, "Error reading header page\n");
+        return ERR_IO;
+    }
+    sprintf(message, "Page size %d\n", header_page.hdr_page_size);
+    mylog(1, message);
+    sprintf(message, "ODS version %x (%s)\n", header_page.hdr_ods_version, ods2str());
+    mylog(1, message);
+
+    //CHECKS
+
+    //Check argument compatibility
+    //Args -d и -P incompatible
+    if (progress_bar_step > 0 && log_level > 1) {
+        fprintf(stderr, "Progress bar and debug level greater than 1 are incompatible.\n");
+        return 1;
+    }
 
     //Check ODS version
     if (!is_supported_ods()) {
@@ -637,47 +4062,147 @@ int main(int argc, char *argv[]) {
 
     stat(db_filename, &fstat_before);
     total_pages = fstat_before.st_size / header_page.hdr_page_size;
+    if (max_extents_per_gib && (gib_extents = calloc((fstat_before.st_size >> 30) + 1, sizeof(long))) == NULL) {
+        fprintf(stderr, "Error allocating memory for extents per GiB\n");
+        close(fd);
+        return ERR_MEM;
+    }
+    file_extents_before = file_extents();
+
+    status = build_hole_map();
+    if (status != 0) {
+        close(fd);
+        return status;
+    }
+    byte2str(buf4size, hole_pages * header_page.hdr_page_size);
+    sprintf(message, "Holes in file %ld pages (%s), extents %ld\n", hole_pages, buf4size, holes_count);
+    mylog(1, message);
+    if (file_extents_before >= 0) {
+        sprintf(message, "File extents %ld\n", file_extents_before);
+        mylog(1, message);
+    }
+
+    if (io_idle && (status = set_io_idle()) != 0) {
+        close(fd);
+        return status;
+    }
+    if (control_filename) {
+        struct stat control_stat;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = control_signal;
+        //Reads and fallocate calls are restarted, SIGHUP doesn't fail them with EINTR
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGHUP, &action, NULL);
+        if (stat(control_filename, &control_stat) == 0) {
+            control_mtime = control_stat.st_mtime;
+            control_file_read();
+        }
+    }
+    if (log_level >= 3 && (status = log_writer_start()) != 0) {
+        close(fd);
+        return status;
+    }
 
     //Stage 1
+    stage1_trim_deferred = (stage == 2 && !plan_apply_filename && !deadline);
+    struct timespec stage1_started;
+    clock_gettime(CLOCK_MONOTONIC, &stage1_started);
     status = stage1();
+    stage1_seconds = seconds_since(&stage1_started);
+    log_flush();
     if (status != 0) {
         close(fd);
         return status;
     }
 
     byte2str(buf4size, pages_for_trim * header_page.hdr_page_size);
-    sprintf(message, "Stage 1: Pages for trim %ld (%s)\n", pages_for_trim, buf4size);
+    sprintf(message, "Stage 1: Pages for trim %ld (%s), extents %ld, free pages in holes %ld\n",
+            pages_for_trim, buf4size, extents_for_trim, free_pages_in_holes);
     mylog(1, message);
 
+    //Free blocks of pages are taken from plan instead of stage 2
+    if (plan_apply_filename) {
+        err = plan_apply();
+        if (trim)
+            file_extents_after = file_extents();
+        policy_report();
+        if ((status = metrics_write(err)) != 0 && err == 0)
+            err = status;
+        log_writer_stop();
+        close(fd);
+        free(free_runs);
+        free(holes);
+        free(gib_extents);
+        return err;
+    }
+
+    //Free blocks of pages are estimated by sample instead of stage 2, stage 1 is exact
+    if ((sample_percent > 0 || sample_error > 0) && stage == 2) {
+        if (direct_io)
+            direct_io_open();
+        err = sample_stage2();
+        log_writer_stop();
+        if (fd_read != fd)
+            close(fd_read);
+        close(fd);
+        free(free_runs);
+        free(holes);
+        free(gib_extents);
+        return err;
+    }
+
+    //Stage 2 tasks
+    task_pages = TASK_SIZE / header_page.hdr_page_size;
+    tasks_count = (total_pages + task_pages - 1) / task_pages;
+    task_blocks = malloc(tasks_count * sizeof(long));
+    if (task_blocks == NULL) {
+        fprintf(stderr, "Error allocating memory for tasks\n");
+        return ERR_MEM;
+    }
+    for (long task = 0; task < tasks_count; task++) {
+        task_blocks[task] = TASK_NOT_DONE;
+    }
+
     if (status_filename)
     {
+        checkpoint_buffer = malloc(status_file_copy_size(tasks_count));
+        if (checkpoint_buffer == NULL) {
+            fprintf(stderr, "Error allocating memory for status file\n");
+            return ERR_MEM;
+        }
         if (access(status_filename, F_OK) == 0) {
             // status file exists
+            struct status_file_header status_header;
+            long *status_tasks;
             fd_status_file = open(status_filename, O_RDWR, 00660);
             if (fd_status_file < 0) {
                 fprintf(stderr, "Error %d open file %s\n", fd_status_file, status_filename);
                 return ERR_IO;
             }
-            if (read(fd_status_file, &ver_status_file, sizeof(ver_status_file)) != sizeof(ver_status_file))
-            {
-                fprintf(stderr, "Error read status file");
-                return ERR_IO;
-            }
-            if (ver_status_file != VER_STATUS_FILE)
-            {
-                fprintf(stderr, "Incompatible version status file %d\n", ver_status_file);
-                return ERR_INCMP;
+            if ((err = status_file_read(fd_status_file, &status_header, &status_tasks)))
+                return err;
+            if ((err = status_file_check(&status_header, status_tasks))) {
+                free(status_tasks);
+                return err;
             }
-            if (read(fd_status_file, &threads_count, sizeof(threads_count)) != sizeof(threads_count))
-            {
-                fprintf(stderr, "Error read status file");
-                return ERR_IO;
+            memcpy(task_blocks, status_tasks, tasks_count * sizeof(long));
+            free(status_tasks);
+            checkpoint_sequence = status_header.sequence;
+            for (long task = 0; task < tasks_count; task++) {
+                if (task_blocks[task] != TASK_NOT_DONE)
+                    tasks_done++;
             }
-            if ((threads_count < 1) || (threads_count > MAX_THREADS)){
-                fprintf(stderr, "Wrong threads count from file. Threads count must be between 1 and %d\n", MAX_THREADS);
-                return ERR_INCMP;
+            sprintf(message, "Loaded status file checkpoint %ld, done tasks %ld / %ld\n",
+                    checkpoint_sequence, tasks_done, tasks_count);
+            mylog(1, message);
+            if (!threads_count_set && status_header.threads_count >= 1 && status_header.threads_count <= MAX_THREADS)
+                threads_count = status_header.threads_count;
+            if (status_header.threads_count != threads_count) {
+                sprintf(message, "Status file is saved by %d threads, continue with %d threads\n",
+                        status_header.threads_count, threads_count);
+                mylog(1, message);
             }
-            load_from_status_file = 1;
         } else {
             // status file doesn't exist
             fd_status_file = open(status_filename, O_CREAT | O_RDWR, 00660);
@@ -685,81 +4210,186 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Error %d open file %s\n", fd_status_file, status_filename);
                 return ERR_IO;
             }
-            if (pwrite(fd_status_file, &ver_status_file, sizeof(ver_status_file), 0) != sizeof(ver_status_file)) {
-                fprintf(stderr, "Error writing status file (version)");
-                return ERR_IO;
-            }
-            if (pwrite(fd_status_file, &threads_count, sizeof(threads_count), sizeof(ver_status_file)) != sizeof(threads_count)) {
-                fprintf(stderr, "Error writing status file (threads_count)");
-                return ERR_IO;
-            }
+            //Both copies are written, file size gives the size of copy
+            if ((err = status_file_write()) || (err = status_file_write()))
+                return err;
         }
     }
 
     //Stage 2
     if (stage == 2) {
-        if (progress_bar_step > 0) {
-            for (long thread = 0; thread < threads_count; thread++) {
-                //Progress bar
-                fprintf(stdout, "Thr %ld\t", thread);
-            }
-            fprintf(stdout, "\n");
-            fsync(STDOUT_FILENO);
+        init_classify();
+        init_zero_blocks();
+        if (probe_pages && block_size == header_page.hdr_page_size) {
+            mylog(1, "block size is equal page size, probe is not used\n");
+            probe_pages = 0;
         }
-        for (int thread = 0; thread < threads_count; thread++) {
-            //todo: Add loading and verification of variables from the file status
-            if (load_from_status_file)
-            {
-                long bytes_read = pread(fd_status_file, &stage2_status[thread], sizeof(stage2_status[thread]),
-                                            sizeof(ver_status_file) + sizeof(threads_count) + sizeof(stage2_status[thread]) * thread);
-                if (bytes_read != sizeof(stage2_status[thread]))
-                {
-                    fprintf(stderr, "Error read data in status file. Read %ld, must %ld\n", sizeof(stage2_status[thread]), bytes_read);
-                    return 0;
-                }
-                if (stage2_status[thread].error)
-                {
-                    fprintf(stderr, "Thread %d return error %d. Can't load from file", thread, stage2_status[thread].error);
-                    return ERR_INCMP;
-                }
-                //todo Add check start, finish and position
-            }
-            else
-            {
-                stage2_status[thread].thread_number = thread;
-                stage2_status[thread].start = total_pages * (thread) / threads_count;
-                stage2_status[thread].position = stage2_status[thread].start;
-                stage2_status[thread].finish = total_pages * (thread + 1) / threads_count;
+        if (manifest_filename && !is_scn_supported()) {
+            mylog(1, "Page SCN is supported since ODS12, manifest is not used\n");
+        } else if (manifest_filename) {
+            task_scn = calloc(tasks_count, sizeof(ULONG));
+            if (task_scn == NULL) {
+                fprintf(stderr, "Error allocating memory for tasks\n");
+                return ERR_MEM;
             }
-            if (log_level >= 2) {
-                sprintf(message, "Starting thread %d range %ld - %ld\n",
-                        thread, stage2_status[thread].start, stage2_status[thread].finish);
-                mylog(2, message);
+            if (incremental && (status = manifest_read()) != 0)
+                return status;
+        }
+        if (direct_io)
+            direct_io_open();
+        if (use_io_uring) {
+#ifdef HAVE_IO_URING
+            struct uring ring;
+            if (uring_init(&ring, URING_ENTRIES)) {
+                mylog(1, "io_uring is unavailable, use pread\n");
+                use_io_uring = 0;
+            } else {
+                if (!ring.fallocate_supported)
+                    mylog(1, "io_uring doesn't support fallocate, use synchronous fallocate\n");
+                uring_free(&ring);
             }
+#else
+            mylog(1, "pluck is built without io_uring, use pread\n");
+            use_io_uring = 0;
+#endif
+        }
+        if (deadline && (status = deadline_order_tasks()) != 0)
+            return status;
+        clock_gettime(CLOCK_MONOTONIC, &stage2_started);
+        checkpoint_time = stage2_started.tv_sec;
+        for (long task = 0; task < tasks_count; task++) {
+            if (task_blocks[task] != TASK_NOT_DONE)
+                progress_resumed_pages += task_start(task + 1) - task_start(task);
+        }
+        for (int thread = 0; thread < threads_count; thread++) {
+            stage2_status[thread].thread_number = thread;
             pthread_create(&(stage2_thread_id[thread]), NULL, stage2, &stage2_status[thread]);
         }
+        stage2_threads = threads_count;
+        if (progress_bar_step > 0)
+            pthread_create(&progress_thread_id, NULL, stage2_progress, NULL);
         for (long thread = 0; thread < threads_count; thread++) {
             pthread_join(stage2_thread_id[thread], NULL);
-            blocks_for_trim += stage2_status[thread].blocks_for_trim;
+            bytes_read += stage2_stats[thread].bytes_read;
+            extents += stage2_stats[thread].extents;
+            pages_hole += stage2_stats[thread].pages_hole;
+            pages_unchanged += stage2_stats[thread].pages_unchanged;
+            blocks_trimmed += stage2_status[thread].blocks_for_trim;
             if (stage2_status[thread].error > 0) {
                 fprintf(stderr, "Error %d on thread %ld\n", stage2_status[thread].error, thread);
                 err = stage2_status[thread].error;
             }
         }
+        if (err && trim && stage1_trim_deferred) {
+            mylog(1, "Stage 2 is not complete, trim free pages of tasks not done\n");
+            if (stage2_trim_rest())
+                fprintf(stderr, "fallocate failed\n");
+            extents += main_stats.extents;
+        }
+        if (progress_bar_step > 0) {
+            pthread_mutex_lock(&mutex_progress);
+            progress_stop = 1;
+            pthread_cond_signal(&cond_progress);
+            pthread_mutex_unlock(&mutex_progress);
+            pthread_join(progress_thread_id, NULL);
+        }
+        //Done tasks are saved even if some thread failed
+        if ((status = status_file_checkpoint(0, 1)) != 0)
+            err = status;
+        //SCN of tasks done by previous run of status file is unknown, it is 0 in manifest
+        //Dry run doesn't trim free blocks, pages skipped by the next run would keep them
+        if (task_scn && trim && err == 0 && tasks_done == tasks_count && (status = manifest_write()) != 0)
+            err = status;
+        if (plan_save_filename && err == 0 && (status = plan_write()) != 0)
+            err = status;
+        for (int thread = 0; objects_enabled && thread < threads_count; thread++) {
+            if ((status = objects_merge(&objects_total, &stage2_stats[thread].objects)) != 0)
+                err = status;
+        }
+        if (objects_enabled)
+            objects_sort(&objects_total);
+        for (int thread = 0; thread < threads_count; thread++) {
+            free(plan_thread[thread].pages);
+        }
+        for (long task = 0; manifest_scn && task < tasks_count; task++) {
+            if (task_scn[task] > (task < manifest_tasks_count ? manifest_task_scn[task] : 0))
+                tasks_changed++;
+        }
+        //Blocks of tasks done by previous runs are included
+        for (long task = 0; task < tasks_count; task++) {
+            if (task_blocks[task] != TASK_NOT_DONE)
+                blocks_for_trim += task_blocks[task];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stage2_finished);
+        stage2_seconds = (double) (stage2_finished.tv_sec - stage2_started.tv_sec) +
+                         (double) (stage2_finished.tv_nsec - stage2_started.tv_nsec) / 1e9;
         if (progress_bar_step > 0) {
             fprintf(stdout, "\n");
         }
     }
 
+    if (trim)
+        file_extents_after = file_extents();
+    if ((status = metrics_write(err)) != 0 && err == 0)
+        err = status;
+    log_writer_stop();
+    if (fd_read != fd)
+        close(fd_read);
     close(fd);
+    free(free_runs);
+    free(holes);
+    free(task_blocks);
+    free(gib_extents);
+    free(task_scn);
+    free(task_order);
+    free(manifest_task_scn);
+    free(checkpoint_buffer);
     if (fd_status_file) {
         close(fd_status_file);
     }
     if (stage == 2) {
         byte2str(buf4size, blocks_for_trim * block_size);
-        sprintf(message, "Stage 2: Blocks for trim %ld (%s)\n", blocks_for_trim, buf4size);
+        sprintf(message, "Stage 2: Blocks for trim %ld (%s), extents with free pages %ld\n",
+                blocks_for_trim, buf4size, extents);
+        mylog(1, message);
+        sprintf(message, "Stage 2: Pages analyzed %ld, skipped free pages %ld\n",
+                total_pages - pages_for_trim - pages_hole, pages_for_trim);
+        mylog(2, message);
+        sprintf(message, "Stage 2: Skipped allocated pages in holes %ld\n", pages_hole);
+        mylog(1, message);
+        if (manifest_scn) {
+            sprintf(message, "Stage 2: Skipped unchanged pages %ld, tasks with changed pages %ld / %ld\n",
+                    pages_unchanged, tasks_changed, tasks_count);
+            mylog(1, message);
+        }
+        const double seconds = (double) (stage2_finished.tv_sec - stage2_started.tv_sec) +
+                               (double) (stage2_finished.tv_nsec - stage2_started.tv_nsec) / 1e9;
+        byte2str(buf4size, bytes_read);
+        sprintf(message, "Stage 2: Read %s in %.1f s (%.1f MiB/s)\n", buf4size, seconds,
+                seconds > 0 ? (double) bytes_read / 1048576 / seconds : 0);
+        mylog(1, message);
+        if (objects_enabled)
+            objects_report();
+        free(objects_total.slots);
+    }
+    if (deadline) {
+        const long estimated = (pages_for_trim - free_pages_in_holes) * header_page.hdr_page_size +
+                               estimated_blocks * block_size;
+        char estimated_size[32];
+        byte2str(buf4size, stage1_pages_trimmed * header_page.hdr_page_size + blocks_trimmed * block_size);
+        byte2str(estimated_size, estimated);
+        snprintf(message, sizeof(message), "Deadline: %s %s of estimated %s\n", trim ? "Reclaimed" : "Found",
+                 buf4size, estimated_size);
+        mylog(1, message);
+        snprintf(message, sizeof(message), "Deadline: Stage 1 pages %ld / %ld, stage 2 tasks done %ld / %ld\n",
+                 stage1_pages_trimmed, pages_for_trim - free_pages_in_holes, stage == 2 ? tasks_done : 0,
+                 stage == 2 ? tasks_count : 0);
         mylog(1, message);
+        if (deadline_reached)
+            mylog(1, status_filename ? "Deadline is reached, run again with the same status file to continue\n" :
+                                       "Deadline is reached, run again to continue\n");
     }
+    policy_report();
     stat(db_filename, &fstat_after);
     if (trim) {
         if (log_level >= 2) {